@@ -7,8 +7,9 @@
 #include <geolib/datatypes.h>
 
 class EntityUpdate;
+class FrameContext;
 
-void associateAndUpdate(const std::vector<ed::EntityConstPtr>& entities, const rgbd::ImageConstPtr& image, const geo::Pose3D& sensor_pose,
+void associateAndUpdate(const std::vector<ed::EntityConstPtr>& entities, const FrameContext& frame,
                         std::vector<EntityUpdate>& clusters, ed::UpdateRequest& req);
 
 #endif
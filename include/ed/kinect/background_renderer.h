@@ -0,0 +1,135 @@
+#ifndef ED_KINECT_BACKGROUND_RENDERER_H_
+#define ED_KINECT_BACKGROUND_RENDERER_H_
+
+#include "ed_sensor_integration/entity_culler.h"
+#include "ed/kinect/world_overlay.h"
+
+#include <ed/types.h>
+#include <geolib/datatypes.h>
+#include <opencv2/core/core.hpp>
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+namespace geo
+{
+    class DepthCamera;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+struct BackgroundRenderStats
+{
+    BackgroundRenderStats() : hits(0), partial_hits(0), misses(0) {}
+
+    // Number of renders in which the cached depth buffer could be used as-is
+    unsigned int hits;
+
+    // Number of renders in which only changed entities (and the entities overlapping them) were re-rendered
+    unsigned int partial_hits;
+
+    // Number of renders in which the whole depth buffer was re-rendered
+    unsigned int misses;
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+// Renders the world model as seen by the depth sensor, and keeps the result. As long as the sensor
+// does not move more than the given tolerance, subsequent renders only re-render the entities of
+// which the shape or pose changed. Next to the depth, the renderer keeps for each pixel which entity
+// was rendered there.
+class BackgroundRenderer
+{
+
+public:
+
+    BackgroundRenderer();
+
+    ~BackgroundRenderer();
+
+    // Entities are rendered at their pose in the overlay (a world model can be passed directly). If the cached render
+    // is used, changed entities are rendered from the sensor pose of the cached render, not from the given one
+    // (which is within the tolerance), such that the whole image stays consistent.
+    const cv::Mat& render(const WorldOverlay& world, const geo::DepthCamera& cam, const geo::Pose3D& sensor_pose,
+                          int width, int height);
+
+    void setSensorPoseTolerance(double max_translation, double max_rotation);
+
+    // Number of threads used when the whole depth buffer is rendered
+    void setNumThreads(unsigned int num_threads) { num_threads_ = std::max(1u, num_threads); }
+
+    void clear();
+
+    const BackgroundRenderStats& stats() const { return stats_; }
+
+    // Depth image of the last render
+    const cv::Mat& depth() const { return depth_; }
+
+    // Per pixel index (CV_32SC1) of the entity that is visible in the last render, or -1 if no entity is
+    // visible. The index refers to entityIds()
+    const cv::Mat& entityIndexImage() const { return entity_index_; }
+
+    // Ids of the rendered entities. May contain ids of entities that are no longer visible. The indices of
+    // removed entities are reused, so the list does not grow beyond the number of entities rendered at once.
+    const std::vector<ed::UUID>& entityIds() const { return entity_ids_; }
+
+private:
+
+    struct CachedEntity
+    {
+        geo::ShapeConstPtr shape;
+        int shape_revision;
+        geo::Pose3D pose;
+
+        // Image area the entity covered the last time it was rendered completely
+        cv::Rect rect;
+
+        // Index with which the entity is labeled in entity_index_, or -1 if it was not rendered
+        int index;
+
+        bool seen;
+    };
+
+    cv::Mat depth_;
+
+    cv::Mat entity_index_;
+
+    std::vector<ed::UUID> entity_ids_;
+
+    // Indices in entity_ids_ that are no longer used in entity_index_
+    std::vector<int> free_indices_;
+
+    // Sensor pose and camera intrinsics with which depth_ was rendered
+    geo::Pose3D sensor_pose_;
+    double fx_, fy_, cx_, cy_;
+
+    std::map<ed::UUID, CachedEntity> entities_;
+
+    double max_translation_;
+    double max_rotation_;
+
+    BackgroundRenderStats stats_;
+
+    ed_sensor_integration::EntityCuller culler_;
+
+    unsigned int num_threads_;
+
+    // Per-thread depth and index buffers (the first ones are depth_ and entity_index_ themselves)
+    std::vector<cv::Mat> thread_buffers_;
+    std::vector<cv::Mat> thread_index_buffers_;
+
+    bool isValid(const geo::DepthCamera& cam, const geo::Pose3D& sensor_pose, int width, int height) const;
+
+    void renderAll(const WorldOverlay& world, const geo::DepthCamera& cam);
+
+    int getEntityIndex(const ed::EntityConstPtr& e);
+
+    // Makes the index of the entity available again. Its pixels must have been cleared.
+    void releaseEntityIndex(const ed::EntityConstPtr& e);
+
+    void updateCachedEntity(const ed::EntityConstPtr& e, const geo::Pose3D& pose, const cv::Rect& rect, int index);
+
+};
+
+#endif
@@ -24,7 +24,7 @@ public:
         return rays_[i] * depth;
     }
 
-    inline void CalculatePoints(const std::vector<double>& ranges, std::vector<geo::Vec2>& points)
+    inline void CalculatePoints(const std::vector<double>& ranges, std::vector<geo::Vec2>& points) const
     {
         static double nan = 0.0 / 0.0;
         points.resize(ranges.size());
@@ -40,6 +40,16 @@ public:
     void RenderModel(const std::vector<std::vector<geo::Vec2> >& contours, const geo::Transform2& pose, int identifier,
                      std::vector<double>& ranges, std::vector<int>& identifiers) const;
 
+    // Range of the contours along a single beam (0 if the beam does not hit them). Same as the range RenderModel() gives
+    // for that beam on empty ranges, but without rendering the other beams.
+    double RenderBeam(const std::vector<std::vector<geo::Vec2> >& contours, const geo::Transform2& pose, int i_beam) const;
+
+    // Same as the above, but for contours that are already rotated: they are only translated
+    void RenderModel(const std::vector<std::vector<geo::Vec2> >& contours, const geo::Vec2& translation, int identifier,
+                     std::vector<double>& ranges, std::vector<int>& identifiers) const;
+
+    double RenderBeam(const std::vector<std::vector<geo::Vec2> >& contours, const geo::Vec2& translation, int i_beam) const;
+
     inline unsigned int num_beams() const { return rays_.size(); }
 
     inline const std::vector<geo::Vec2>& rays() const { return rays_; }
@@ -0,0 +1,60 @@
+#ifndef ED_KINECT_DISTANCE_FIELD_H_
+#define ED_KINECT_DISTANCE_FIELD_H_
+
+#include <geolib/datatypes.h>
+#include <opencv2/core/core.hpp>
+
+#include <algorithm>
+#include <vector>
+
+// ----------------------------------------------------------------------------------------------------
+
+// Distance from each cell of a 2D grid to the closest of a set of points (in meters). The grid covers the
+// points plus a margin.
+class DistanceField2D
+{
+
+public:
+
+    DistanceField2D();
+
+    ~DistanceField2D();
+
+    void calculate(const std::vector<geo::Vec2>& points, double resolution, double margin);
+
+    void clear() { field_ = cv::Mat(); }
+
+    bool empty() const { return field_.empty(); }
+
+    // Distance of p to the closest point, cut off at the margin. Outside the grid, the distance is at least the
+    // margin, so the margin is returned. Within the grid (e.g., in its corners) the field can exceed the margin, so
+    // it is cut off there as well, such that the distance is continuous at the grid border.
+    double distance(const geo::Vec2& p) const
+    {
+        int x = (p.x - origin_.x) / resolution_;
+        int y = (p.y - origin_.y) / resolution_;
+
+        if (p.x < origin_.x || p.y < origin_.y || x >= field_.cols || y >= field_.rows)
+            return margin_;
+
+        return std::min<double>(field_.at<float>(y, x), margin_);
+    }
+
+private:
+
+    // CV_32FC1, distance per cell in meters
+    cv::Mat field_;
+
+    // Points as zero pixels (CV_8UC1), input of the distance transform
+    cv::Mat mask_;
+
+    // Position of the corner of the first cell
+    geo::Vec2 origin_;
+
+    double resolution_;
+
+    double margin_;
+
+};
+
+#endif
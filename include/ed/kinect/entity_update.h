@@ -12,7 +12,8 @@ struct EntityUpdate
     bool is_new;
     ed::UUID id;
 
-    // Measurement
+    // Measurement (the pixel indices are at full image resolution, the points may be taken from a lower
+    // resolution, see DownsampleFactors)
     std::vector<unsigned int> pixel_indices;
     std::vector<geo::Vec3> points;
 
@@ -10,9 +10,18 @@
 
 #include "beam_model.h"
 
+#include "ed_sensor_integration/entity_culler.h"
+
+#include "ed/kinect/point_cloud.h"
+#include "ed/kinect/distance_field.h"
+
 // Model loading
 #include <ed/models/model_loader.h>
 
+#include <boost/thread/mutex.hpp>
+
+#include <algorithm>
+
 typedef std::vector<std::vector<geo::Vec2> > Shape2D;
 
 // ----------------------------------------------------------------------------------------------------
@@ -31,6 +40,26 @@ struct FitterData
     geo::Pose3D sensor_pose;
     geo::Pose3D sensor_pose_xya;
     geo::Pose3D sensor_pose_zrp;
+
+    // Distance to the measured points, in the XY plane of sensor_pose_xya. Only calculated for distance field scoring.
+    DistanceField2D distance_field;
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+// Outcome of the refinement of the fitted pose (see Fitter::setRefinement())
+struct FitterRefinement
+{
+    FitterRefinement() : iterations(0), converged(false), accepted(false) {}
+
+    // Number of Gauss-Newton iterations done
+    unsigned int iterations;
+
+    // Whether the steps became negligible within the maximum number of iterations
+    bool converged;
+
+    // Whether the refined pose is used. It is not if its error is larger than the error of the best grid pose.
+    bool accepted;
 };
 
 // ----------------------------------------------------------------------------------------------------
@@ -40,21 +69,75 @@ class Fitter
 
 public:
 
+    enum ScoringMethod
+    {
+        // Renders each candidate into the beams of the rest of the world model, and compares the beams
+        BEAM_SCORING,
+
+        // Looks up the distance of the (visible) contour points of each candidate to the measured points, instead of
+        // rendering it. Faster, but only approximates the beam error, and handles occlusion approximately.
+        DISTANCE_FIELD_SCORING
+    };
+
     Fitter();
 
     ~Fitter();
 
+    // Not re-entrant: the image overloads share the point cloud buffers of the fitter
     void processSensorData(const rgbd::Image& image, const geo::Pose3D& sensor_pose, FitterData& data);
     void processSensorData(const rgbd::Image& image, const geo::Pose3D& sensor_pose, FitterData& data, bool include, float min, float max);
 
+    // Same as above, but uses the point cloud of the frame
+    void processSensorData(OrganizedPointCloud& cloud, FitterData& data);
+    void processSensorData(OrganizedPointCloud& cloud, FitterData& data, bool include, float min, float max);
+
 
     void renderEntity(const ed::EntityConstPtr& e, const geo::Pose3D& sensor_pose_xya, int identifier,
                       std::vector<double>& model_ranges, std::vector<int>& identifiers);
 
+    // Re-entrant: can be called from multiple threads at once (as long as the settings are not changed meanwhile)
     bool estimateEntityPose(const FitterData& data, const ed::WorldModel& world, const ed::UUID& id,
-                   const geo::Pose3D& expected_pose, geo::Pose3D& fitted_pose, double max_yaw_change = M_PI, bool state_update = false);
+                   const geo::Pose3D& expected_pose, geo::Pose3D& fitted_pose, double max_yaw_change = M_PI, bool state_update = false,
+                   FitterRefinement* refinement = 0);
+
+    // The returned reference stays valid as long as the fitter exists. Thread-safe.
+    const EntityRepresentation2D& GetOrCreateEntity2D(const ed::EntityConstPtr& e);
+
+    // By default, candidate poses are pruned using lower bounds on their error (branch-and-bound). Exhaustive
+    // search evaluates all candidates, and results in the same pose. Only useful for comparison.
+    void setExhaustiveSearch(bool b) { exhaustive_search_ = b; }
 
-    EntityRepresentation2D GetOrCreateEntity2D(const ed::EntityConstPtr& e);
+    void setScoringMethod(ScoringMethod method) { scoring_method_ = method; }
+
+    ScoringMethod scoringMethod() const { return scoring_method_; }
+
+    // Cell size (m) of the distance field used by distance field scoring, and the margin (m) it extends beyond the
+    // measured points (distances larger than the margin are cut off). The contours of the shape are sampled with the
+    // same spacing as the cell size.
+    void setDistanceFieldResolution(double resolution, double margin)
+    {
+        distance_field_resolution_ = resolution;
+        distance_field_margin_ = margin;
+    }
+
+    // Candidate poses are placed on every 'beam_step'-th beam, with yaws 'yaw_step' (rad) apart
+    void setSearchResolution(unsigned int beam_step, double yaw_step)
+    {
+        beam_step_ = std::max(1u, beam_step);
+        yaw_step_ = yaw_step;
+    }
+
+    // The best candidate pose is refined with at most this number of Gauss-Newton iterations, on the distances of the
+    // measured points to the contour. With a refinement, the search resolution can be much coarser. 0 (the default)
+    // disables it.
+    void setRefinement(unsigned int max_iterations) { refinement_iterations_ = max_iterations; }
+
+    // Number of threads over which the candidate poses are divided. The fitted pose does not depend on it.
+    void setNumThreads(unsigned int num_threads) { num_threads_ = std::max(1u, num_threads); }
+
+    // Calculates the distance field of the sensor ranges. Done by processSensorData() if distance field scoring is
+    // used; only needed if the sensor ranges are filled in otherwise.
+    void calculateDistanceField(FitterData& data) const;
 
 private:
 
@@ -62,11 +145,35 @@ private:
 
     BeamModel beam_model_;
 
+    // Rejects world model entities outside the field of view of the beam model
+    ed_sensor_integration::EntityCuller culler_;
+
+    // Guards culler_, which holds the view of the current fit
+    boost::mutex culler_mutex_;
+
+    bool exhaustive_search_;
+
+    ScoringMethod scoring_method_;
+
+    double distance_field_resolution_;
+
+    double distance_field_margin_;
+
+    unsigned int beam_step_;
+
+    double yaw_step_;
+
+    unsigned int refinement_iterations_;
+
+    unsigned int num_threads_;
+
 
     // 2D Entity shapes
 
     std::map<ed::UUID, EntityRepresentation2D> entity_shapes_;
 
+    boost::mutex entity_shapes_mutex_;
+
 
     // Models
 
@@ -74,7 +181,11 @@ private:
 
     ed::models::ModelLoader model_loader_;
 
-    void processSensorDataImpl(const rgbd::Image& image, const geo::Pose3D& sensor_pose, FitterData& data, bool apply_roi, bool include, float min, float max) const;
+    // Used when processing images directly
+    RayTable ray_table_;
+    OrganizedPointCloud cloud_;
+
+    void processSensorDataImpl(OrganizedPointCloud& cloud, FitterData& data, bool apply_roi, bool include, float min, float max) const;
 
 };
 
@@ -0,0 +1,53 @@
+#ifndef ED_KINECT_FRAME_ARENA_H_
+#define ED_KINECT_FRAME_ARENA_H_
+
+#include <opencv2/core/core.hpp>
+
+#include <vector>
+
+// ----------------------------------------------------------------------------------------------------
+
+// Memory for the temporary images and arrays of an update, kept between frames. Buffers are handed out
+// per slot, and a slot only grows (reallocates) if a larger buffer is asked for than before. After the first
+// frames, the buffers taken from the arena therefore do not allocate memory anymore. Other temporaries of an
+// update are not covered. Counts the slot growths since the start of the frame.
+//
+// Not thread-safe, except that different slots can be used concurrently once they exist (see reserve()).
+class FrameArena
+{
+
+public:
+
+    FrameArena();
+
+    ~FrameArena();
+
+    // Starts a new frame (resets the growth count). Buffers handed out earlier become invalid.
+    void newFrame();
+
+    // Makes sure there are at least the given number of image and array slots
+    void reserve(unsigned int num_image_slots, unsigned int num_array_slots);
+
+    // Float image (CV_32FC1) of the given size (contents undefined). It shares its memory with the slot, so
+    // it is only valid until the slot is used again.
+    cv::Mat floatImage(unsigned int slot, int rows, int cols);
+
+    // Int array of the given size (contents undefined)
+    std::vector<int>& intArray(unsigned int slot, unsigned int size);
+
+    // Number of times a slot grew since the start of the frame. Only counts the arena buffers, not other heap
+    // allocations.
+    unsigned int numGrowths() const;
+
+private:
+
+    std::vector<cv::Mat> images_;
+    std::vector<std::vector<int> > arrays_;
+
+    // Growth counts per slot (such that slots can be used concurrently)
+    std::vector<unsigned int> image_growths_;
+    std::vector<unsigned int> array_growths_;
+
+};
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef ED_KINECT_FRAME_CONTEXT_H_
+#define ED_KINECT_FRAME_CONTEXT_H_
+
+#include "ed/kinect/point_cloud.h"
+
+#include <rgbd/types.h>
+#include <geolib/datatypes.h>
+#include <geolib/sensors/DepthCamera.h>
+#include <opencv2/core/core.hpp>
+
+#include <map>
+
+// ----------------------------------------------------------------------------------------------------
+
+// Depth image of a frame at a certain resolution, with the corresponding camera model and point cloud
+struct DepthLevel
+{
+    DepthLevel() : valid(false) {}
+
+    // Whether the level is calculated for the current frame
+    bool valid;
+
+    cv::Mat depth;
+    geo::DepthCamera cam;
+
+    RayTable rays;
+    OrganizedPointCloud cloud;
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+// Data of a single camera frame that is shared by the stages of an update: the image, the sensor pose (and
+// its inverse), the camera model, and the depth image at the resolutions that are used. Everything is
+// derived once per frame. The buffers of the depth levels are kept between frames.
+class FrameContext
+{
+
+public:
+
+    FrameContext();
+
+    ~FrameContext();
+
+    // Starts a new frame
+    void setFrame(const rgbd::ImageConstPtr& image, const geo::Pose3D& sensor_pose);
+
+    // Changes the sensor pose of the current frame (e.g., after it is corrected). The point clouds of the
+    // depth levels are recalculated on their next use.
+    void setSensorPose(const geo::Pose3D& sensor_pose);
+
+    const rgbd::ImageConstPtr& image() const { return image_; }
+
+    // Full resolution depth image and camera model
+    const cv::Mat& depth() const { return depth_; }
+    const geo::DepthCamera& cam() const { return cam_; }
+
+    const geo::Pose3D& sensorPose() const { return sensor_pose_; }
+    const geo::Pose3D& sensorPoseInv() const { return sensor_pose_inv_; }
+
+    // Depth image downsampled with the given factor (1 = full resolution). Calculated on first use.
+    DepthLevel& level(int factor);
+
+private:
+
+    rgbd::ImageConstPtr image_;
+
+    cv::Mat depth_;
+
+    geo::DepthCamera cam_;
+
+    geo::Pose3D sensor_pose_;
+
+    geo::Pose3D sensor_pose_inv_;
+
+    // Per downsample factor, only for the factors that are used
+    std::map<int, DepthLevel> levels_;
+
+    void invalidateLevels();
+
+};
+
+#endif
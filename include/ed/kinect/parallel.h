@@ -0,0 +1,118 @@
+#ifndef ED_KINECT_PARALLEL_H_
+#define ED_KINECT_PARALLEL_H_
+
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+// ----------------------------------------------------------------------------------------------------
+
+// Threads that are kept alive between parallel jobs, such that starting a job does not create threads. Can run
+// one job at a time; grows to the largest number of threads asked for.
+class ThreadPool
+{
+
+public:
+
+    typedef void (*Function)(void* job, unsigned int i_thread);
+
+    // The pool shared by all calls to runParallel()
+    static ThreadPool& instance();
+
+    // Calls function(job, i_thread) for every i_thread in [1, num_threads) on the pool threads and
+    // function(job, 0) in the calling thread. Returns when all calls are finished. Returns false without calling
+    // anything if the pool is already running a job (e.g., for nested or concurrent calls).
+    bool run(unsigned int num_threads, Function function, void* job);
+
+private:
+
+    ThreadPool();
+
+    ~ThreadPool();
+
+    void work(unsigned int i_thread, unsigned int generation);
+
+    boost::mutex mutex_;
+
+    // Signals the pool threads that a job started (or that the pool stops)
+    boost::condition_variable start_condition_;
+
+    // Signals the calling thread that all pool threads finished the job
+    boost::condition_variable done_condition_;
+
+    boost::thread_group threads_;
+
+    unsigned int num_pool_threads_;
+
+    // Incremented for every job
+    unsigned int generation_;
+
+    bool busy_;
+
+    bool stop_;
+
+    // Current job
+    Function function_;
+    void* job_;
+    unsigned int num_threads_;
+    unsigned int num_pending_;
+
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+template<typename Job>
+void callJob(void* job, unsigned int i_thread)
+{
+    (*static_cast<Job*>(job))(i_thread);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+template<typename Job>
+struct ParallelJobRunner
+{
+    ParallelJobRunner(Job& job_, unsigned int i_thread_) : job(&job_), i_thread(i_thread_) {}
+
+    void operator()() { (*job)(i_thread); }
+
+    Job* job;
+    unsigned int i_thread;
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+// Calls job(i_thread) for every i_thread in [0, num_threads). Thread 0 runs in the calling thread, the
+// others on the threads of the shared pool. If the pool is busy, the others get their own thread. Returns
+// when all calls are finished.
+template<typename Job>
+void runParallel(unsigned int num_threads, Job& job)
+{
+    if (num_threads <= 1)
+    {
+        job(0);
+        return;
+    }
+
+    if (ThreadPool::instance().run(num_threads, &callJob<Job>, &job))
+        return;
+
+    boost::thread_group threads;
+    for(unsigned int i = 1; i < num_threads; ++i)
+        threads.create_thread(ParallelJobRunner<Job>(job, i));
+
+    job(0);
+
+    threads.join_all();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Splits [0, size) in 'num_parts' consecutive ranges and returns the range of part 'i_part'
+inline void partitionRange(unsigned int size, unsigned int num_parts, unsigned int i_part, unsigned int& begin, unsigned int& end)
+{
+    begin = (size * i_part) / num_parts;
+    end = (size * (i_part + 1)) / num_parts;
+}
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef ED_KINECT_POINT_CLOUD_H_
+#define ED_KINECT_POINT_CLOUD_H_
+
+#include <geolib/datatypes.h>
+#include <opencv2/core/core.hpp>
+
+#include <vector>
+
+namespace geo
+{
+    class DepthCamera;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Direction of the ray through each pixel, at unit depth (the z-component is always -1). Only recalculated
+// if the camera intrinsics or image resolution change.
+class RayTable
+{
+
+public:
+
+    RayTable();
+
+    ~RayTable();
+
+    void update(const geo::DepthCamera& cam, int width, int height);
+
+    float x(int col) const { return xs_[col]; }
+
+    float y(int row) const { return ys_[row]; }
+
+    int width() const { return xs_.size(); }
+
+    int height() const { return ys_.size(); }
+
+private:
+
+    std::vector<float> xs_;
+    std::vector<float> ys_;
+
+    double fx_, fy_, cx_, cy_;
+
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+// Organized point cloud of a depth image, in sensor and map frame. Points are stored per coordinate
+// (structure-of-arrays), indexed by pixel index. They are only calculated for the image areas that are
+// asked for (see prepare()), and only once per frame.
+class OrganizedPointCloud
+{
+
+public:
+
+    OrganizedPointCloud();
+
+    ~OrganizedPointCloud();
+
+    // Starts a new frame. The depth image and ray table must stay alive while the frame is used.
+    void setFrame(const cv::Mat& depth, const RayTable& rays, const geo::Pose3D& sensor_pose);
+
+    // Makes sure the points within the given image area are calculated. Not thread-safe: prepare the
+    // area before the points are accessed from multiple threads.
+    void prepare(const cv::Rect& roi);
+
+    // The point accessors are only valid for prepared pixels with a valid depth
+
+    geo::Vec3 sensorPoint(int i) const { return geo::Vec3(sensor_x_[i], sensor_y_[i], -(*depth_).at<float>(i)); }
+
+    geo::Vec3 mapPoint(int i) const { return geo::Vec3(map_x_[i], map_y_[i], map_z_[i]); }
+
+    float mapZ(int i) const { return map_z_[i]; }
+
+    const float* sensorX() const { return &sensor_x_[0]; }
+    const float* sensorY() const { return &sensor_y_[0]; }
+
+    const cv::Mat& depth() const { return *depth_; }
+
+    const RayTable& rays() const { return *rays_; }
+
+    const geo::Pose3D& sensorPose() const { return sensor_pose_; }
+
+    int width() const { return depth_->cols; }
+
+    int height() const { return depth_->rows; }
+
+private:
+
+    const cv::Mat* depth_;
+
+    const RayTable* rays_;
+
+    geo::Pose3D sensor_pose_;
+
+    std::vector<float> sensor_x_, sensor_y_;
+    std::vector<float> map_x_, map_y_, map_z_;
+
+    // Per row, the range of columns [begin, end) for which the points are calculated
+    std::vector<int> row_begin_, row_end_;
+
+    void calculate(int y, int x_begin, int x_end);
+
+};
+
+#endif
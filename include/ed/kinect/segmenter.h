@@ -2,6 +2,10 @@
 #define ED_SENSOR_INTEGRATION_SEGMENTER_H_
 
 #include "ed/kinect/entity_update.h"
+#include "ed/kinect/background_renderer.h"
+#include "ed/kinect/point_cloud.h"
+#include "ed/kinect/world_overlay.h"
+#include "ed/kinect/frame_arena.h"
 
 #include <rgbd/types.h>
 #include <geolib/datatypes.h>
@@ -31,17 +35,75 @@ public:
 
     ~Segmenter();
 
-    void removeBackground(cv::Mat& depth_image, const ed::WorldModel& world, const geo::DepthCamera& cam,
+    // Number of threads used for rendering
+    void setNumThreads(unsigned int num_threads);
+
+    unsigned int numThreads() const { return num_threads_; }
+
+    void removeBackground(cv::Mat& depth_image, const WorldOverlay& world, const geo::DepthCamera& cam,
                           const geo::Pose3D& sensor_pose, double background_padding);
 
+    // Only removes the background within the given image area
+    void removeBackground(cv::Mat& depth_image, const WorldOverlay& world, const geo::DepthCamera& cam,
+                          const geo::Pose3D& sensor_pose, double background_padding, const cv::Rect& roi);
+
     void calculatePointsWithin(const rgbd::Image& image, const geo::Shape& shape,
                                const geo::Pose3D& shape_pose, cv::Mat& filtered_depth_image) const;
 
+    // Also returns the image area the shape projects to. All points in filtered_depth_image are within this area.
+    void calculatePointsWithin(const rgbd::Image& image, const geo::Shape& shape,
+                               const geo::Pose3D& shape_pose, cv::Mat& filtered_depth_image, cv::Rect& roi) const;
+
+    // Same as above, for a depth image with the given camera model (e.g., a downsampled image)
+    void calculatePointsWithin(const cv::Mat& depth_image, const geo::DepthCamera& cam_model, const geo::Shape& shape,
+                               const geo::Pose3D& shape_pose, cv::Mat& filtered_depth_image, cv::Rect& roi) const;
+
+    // Same as above, but filtered_window only covers the image area the shape projects to (roi). Useful for
+    // small shapes, as nothing is allocated or visited outside that area. Can be called concurrently; in that
+    // case pass num_threads = 1 (0 means the number of threads given in setNumThreads). If filtered_window is
+    // a float image that is large enough, its memory is used for the window (this holds for all variants).
+    void calculatePointsWithinWindow(const cv::Mat& depth_image, const geo::DepthCamera& cam_model, const geo::Shape& shape,
+                                     const geo::Pose3D& shape_pose, cv::Mat& filtered_window, cv::Rect& roi,
+                                     unsigned int num_threads = 0) const;
+
+    // Combines calculatePointsWithin and removeBackground in a single pass over the depth image
+    void calculatePointsWithinAndRemoveBackground(const cv::Mat& depth_image, const geo::DepthCamera& cam_model,
+                                                  const geo::Shape& shape, const geo::Pose3D& shape_pose,
+                                                  const WorldOverlay& world, const geo::Pose3D& sensor_pose,
+                                                  double background_padding, cv::Mat& filtered_depth_image, cv::Rect& roi);
+
+    // Removes the points of the dominant horizontal plane (e.g., a table top) within the given image area:
+    // all points within 'thickness' of the most frequent height in map frame. The plane must contain at
+    // least a fifth of the points. Returns false (and keeps all points) if there is no such plane.
+    bool removeSupportingPlane(cv::Mat& depth_image, OrganizedPointCloud& cloud, const cv::Rect& roi,
+                               double thickness) const;
+
     void cluster(const cv::Mat& depth_image, const geo::DepthCamera& cam_model,
                  const geo::Pose3D& sensor_pose, std::vector<EntityUpdate>& clusters) const;
 
+    // Only clusters the points within the given image area. The points are taken from the point cloud of
+    // the frame (depth_image only determines which pixels are used). If an arena is given, the labeling
+    // buffers are taken from its array slots 0 and 1.
+    void cluster(const cv::Mat& depth_image, OrganizedPointCloud& cloud, const cv::Rect& roi,
+                 std::vector<EntityUpdate>& clusters, FrameArena* arena = 0) const;
+
+    // Gives access to the world model render of the last background removal
+    const BackgroundRenderer& backgroundRenderer() const { return background_renderer_; }
+
 private:
 
+    // Keeps the rendered world model between updates
+    BackgroundRenderer background_renderer_;
+
+    unsigned int num_threads_;
+
+    // Keeps the points within the shape. If background is given, also removes the points that belong to it.
+    // If window_only is set, the filtered image only covers the roi. Only reads members, so it is safe to call
+    // concurrently.
+    void filterPointsWithin(const cv::Mat& depth_image, const geo::DepthCamera& cam_model, const geo::Shape& shape,
+                            const geo::Pose3D& shape_pose, const cv::Mat* background, double background_padding,
+                            bool window_only, unsigned int max_num_threads, cv::Mat& filtered_depth_image, cv::Rect& roi) const;
+
 };
 
 #endif
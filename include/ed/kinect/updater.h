@@ -4,12 +4,32 @@
 #include "ed/kinect/fitter.h"
 #include "ed/kinect/segmenter.h"
 #include "ed/kinect/entity_update.h"
+#include "ed/kinect/frame_arena.h"
+#include "ed/kinect/frame_context.h"
+
+#include <geolib/sensors/DepthCamera.h>
+
+#include <tue/config/data_pointer.h>
+
+// ----------------------------------------------------------------------------------------------------
+
+// Factors with which the depth image is downsampled in the different stages of the update (1 = full
+// resolution). Segmentation covers the area filter, background removal and clustering, which all work
+// on the same image. The resulting pixel masks are always at full resolution.
+struct DownsampleFactors
+{
+    DownsampleFactors() : fitting(1), segmentation(1), refit(1) {}
+
+    int fitting;
+    int segmentation;
+    int refit;
+};
 
 // ----------------------------------------------------------------------------------------------------
 
 struct UpdateRequest
 {
-    UpdateRequest() : background_padding(0), max_yaw_change(M_PI) {}
+    UpdateRequest() : background_padding(0), max_yaw_change(M_PI), supporting_plane_thickness(0) {}
 
     // Symbolic description of area to be updated (e.g. "on_top_of cabinet")
     std::string area_description;
@@ -21,6 +41,12 @@ struct UpdateRequest
     // When refitting an entity, this states the maximum change in yaw (in radians), i.e., the fitted
     // yaw will deviate at most 'max_yaw_change' from the estimated yaw
     double max_yaw_change;
+
+    // If larger than zero, the dominant horizontal plane (e.g., the table top the objects are on) is removed
+    // before clustering: all points within this distance of the plane height
+    double supporting_plane_thickness;
+
+    DownsampleFactors downsample_factors;
 };
 
 // ----------------------------------------------------------------------------------------------------
@@ -31,6 +57,14 @@ struct UpdateResult
 
     std::vector<EntityUpdate> entity_updates;
     std::vector<ed::UUID> removed_entity_ids;
+
+    // Per pixel index (CV_32SC1) of the world model entity that was rendered as background, or -1 if none.
+    // The index refers to background_entity_ids. Has the resolution of the segmentation stage. Shares its
+    // data with the background render of the updater, so it is only valid until the next update (clone it
+    // to keep it longer).
+    cv::Mat background_entity_index;
+    std::vector<ed::UUID> background_entity_ids;
+
     ed::UpdateRequest& update_req;
     std::stringstream error;
 };
@@ -49,15 +83,61 @@ public:
     bool update(const ed::WorldModel& world, const rgbd::ImageConstPtr& image, const geo::Pose3D& sensor_pose,
                 const UpdateRequest& req, UpdateResult& res, bool apply_roi = false);
 
+    void setNumThreads(unsigned int num_threads)
+    {
+        segmenter_.setNumThreads(num_threads);
+        fitter_.setNumThreads(num_threads);
+    }
+
+    void setFitterScoringMethod(Fitter::ScoringMethod method) { fitter_.setScoringMethod(method); }
+
+    void setFitterSearchResolution(unsigned int beam_step, double yaw_step) { fitter_.setSearchResolution(beam_step, yaw_step); }
+
+    void setFitterRefinement(unsigned int max_iterations) { fitter_.setRefinement(max_iterations); }
+
+    void setFitterDistanceFieldResolution(double resolution, double margin)
+    {
+        fitter_.setDistanceFieldResolution(resolution, margin);
+    }
+
+    // Buffers of the temporaries of the last update (e.g., to see how many of its slots had to grow)
+    const FrameArena& frameArena() const { return arena_; }
+
 private:
 
     Fitter fitter_;
 
+    // Sensor data of the fitter (kept between updates to reuse the buffers, e.g., of the distance field)
+    FitterData fitter_data_;
+
     Segmenter segmenter_;
 
+    // Image, camera model and depth levels of the current frame (kept between updates to reuse the buffers)
+    FrameContext frame_;
+
+    // Temporary buffers of an update, kept between updates
+    FrameArena arena_;
+
     // Stores for each segmented entity with which area description it was found
     std::map<ed::UUID, std::string> id_to_area_description_;
 
+    // Area shape (in entity frame) parsed from the data of an entity. Changing the data of an entity gives it
+    // a new data tree, while other changes (e.g., of the pose) keep the tree. Therefore, the shape is valid as
+    // long as the entity still points to the data node it was parsed from.
+    struct CachedArea
+    {
+        tue::config::DataConstPointer data;
+        geo::ShapeConstPtr shape;
+    };
+
+    // Parsed area shapes per entity and area name
+    std::map<std::pair<ed::UUID, std::string>, CachedArea> area_cache_;
+
+    geo::ShapeConstPtr getAreaShape(const ed::EntityConstPtr& e, const std::string& area_name);
+
+    // Removes the cached areas of entities that are no longer in the world model
+    void pruneAreaCache(const ed::WorldModel& world);
+
     void updateStateGroupPose(const ed::WorldModel& world, const UpdateResult& res, const ed::EntityConstPtr& mainObject, const geo::Pose3D& new_pose);
 
     void updateRestricted(const UpdateResult& res, const ed::EntityConstPtr& mainObject, geo::Pose3D& new_pose);
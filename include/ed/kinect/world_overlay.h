@@ -0,0 +1,60 @@
+#ifndef ED_KINECT_WORLD_OVERLAY_H_
+#define ED_KINECT_WORLD_OVERLAY_H_
+
+#include <ed/entity.h>
+#include <ed/types.h>
+#include <ed/uuid.h>
+#include <geolib/datatypes.h>
+
+#include <map>
+
+// ----------------------------------------------------------------------------------------------------
+
+// A world model with the poses of some entities overridden, without copying the world model. Used to look
+// at the world as it will be after an update request with new poses is applied. The world model must stay
+// alive (and unchanged) while the overlay is used.
+class WorldOverlay
+{
+
+public:
+
+    // Not explicit, such that a world model can be passed wherever an overlay is expected
+    WorldOverlay(const ed::WorldModel& world) : world_(world) {}
+
+    void setPose(const ed::UUID& id, const geo::Pose3D& pose) { poses_[id] = pose; }
+
+    void setPoses(const std::map<ed::UUID, geo::Pose3D>& poses)
+    {
+        for(std::map<ed::UUID, geo::Pose3D>::const_iterator it = poses.begin(); it != poses.end(); ++it)
+            poses_[it->first] = it->second;
+    }
+
+    const ed::WorldModel& world() const { return world_; }
+
+    bool hasPose(const ed::Entity& e) const
+    {
+        return e.has_pose() || (!poses_.empty() && poses_.find(e.id()) != poses_.end());
+    }
+
+    // Only valid if hasPose(e)
+    const geo::Pose3D& pose(const ed::Entity& e) const
+    {
+        if (poses_.empty())
+            return e.pose();
+
+        std::map<ed::UUID, geo::Pose3D>::const_iterator it = poses_.find(e.id());
+        if (it != poses_.end())
+            return it->second;
+
+        return e.pose();
+    }
+
+private:
+
+    const ed::WorldModel& world_;
+
+    std::map<ed::UUID, geo::Pose3D> poses_;
+
+};
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef ED_SENSOR_INTEGRATION_ENTITY_CULLER_H_
+#define ED_SENSOR_INTEGRATION_ENTITY_CULLER_H_
+
+#include <ed/types.h>
+#include <geolib/datatypes.h>
+
+#include <map>
+#include <vector>
+
+namespace geo
+{
+    class DepthCamera;
+}
+
+namespace ed_sensor_integration
+{
+
+// Rejects entities that can not be visible to a sensor, based on a bounding sphere of their shape. The
+// bounding spheres are calculated once per entity shape revision. Bounding spheres of entities that were not
+// looked up since the previous view was set are dropped when a new view is set.
+class EntityCuller
+{
+
+public:
+
+    EntityCuller();
+
+    ~EntityCuller();
+
+    // Only accept entities within the frustum of the given depth camera (max_range <= 0 means no range limit)
+    void setDepthCameraView(const geo::DepthCamera& cam, int width, int height, const geo::Pose3D& sensor_pose,
+                            double max_range = 0);
+
+    // Only accept entities within the 2D wedge [angle_min, angle_max] (counter-clockwise, angles w.r.t. the
+    // sensor x-axis) up to max_range. If 'require_in_plane' is set, the entities must also intersect the sensor
+    // xy-plane (e.g., for a laser range finder)
+    void setPlanarView(const geo::Pose3D& sensor_pose, double angle_min, double angle_max, double max_range,
+                       bool require_in_plane);
+
+    // Returns true if the entity has a shape and pose and may be (partially) visible in the current view
+    bool isVisible(const ed::EntityConstPtr& e);
+
+    // Same as above, but with the entity at the given pose instead of its own
+    bool isVisible(const ed::EntityConstPtr& e, const geo::Pose3D& pose);
+
+    // Calculates the bounding sphere of the entity shape in world frame. Returns false if the entity has
+    // no shape or pose
+    bool getBoundingSphere(const ed::EntityConstPtr& e, geo::Vec3& center, double& radius);
+
+    // Same as above, but with the entity at the given pose instead of its own
+    bool getBoundingSphere(const ed::EntityConstPtr& e, const geo::Pose3D& pose, geo::Vec3& center, double& radius);
+
+private:
+
+    struct LocalBounds
+    {
+        geo::ShapeConstPtr shape;
+        int shape_revision;
+        geo::Vec3 center;
+        double radius;
+
+        // Looked up since the view was last set
+        bool used;
+    };
+
+    std::map<ed::UUID, LocalBounds> bounds_;
+
+    // Removes the bounds that were not used since the previous call (e.g., of removed entities)
+    void pruneBounds();
+
+    // View
+
+    geo::Pose3D sensor_pose_inv_;
+
+    // Normals of the planes through the sensor origin that bound the view (pointing inwards)
+    std::vector<geo::Vec3> planes_;
+
+    // If true, the view is the union of the half spaces instead of the intersection (wedges wider than 180 degrees)
+    bool planes_union_;
+
+    // The sensor looks along the negative z-axis (depth camera)
+    bool looks_along_z_;
+
+    bool require_in_plane_;
+
+    double max_range_;
+
+};
+
+}
+
+#endif
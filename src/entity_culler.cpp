@@ -0,0 +1,212 @@
+#include "ed_sensor_integration/entity_culler.h"
+
+#include <ed/entity.h>
+
+#include <geolib/Shape.h>
+#include <geolib/sensors/DepthCamera.h>
+
+#include <algorithm>
+#include <cmath>
+
+namespace ed_sensor_integration
+{
+
+// ----------------------------------------------------------------------------------------------------
+
+EntityCuller::EntityCuller() : planes_union_(false), looks_along_z_(false), require_in_plane_(false), max_range_(0)
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+EntityCuller::~EntityCuller()
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void EntityCuller::setDepthCameraView(const geo::DepthCamera& cam, int width, int height, const geo::Pose3D& sensor_pose,
+                                      double max_range)
+{
+    pruneBounds();
+
+    sensor_pose_inv_ = sensor_pose.inverse();
+    max_range_ = max_range;
+    looks_along_z_ = true;
+    require_in_plane_ = false;
+    planes_union_ = false;
+
+    // Rays through the image corners
+    geo::Vec3 corners[4] = { cam.project2Dto3D(0, 0), cam.project2Dto3D(width, 0),
+                             cam.project2Dto3D(width, height), cam.project2Dto3D(0, height) };
+
+    geo::Vec3 center_ray = cam.project2Dto3D(width / 2, height / 2);
+
+    planes_.resize(4);
+    for(unsigned int i = 0; i < 4; ++i)
+    {
+        geo::Vec3 n = corners[i].cross(corners[(i + 1) % 4]).normalized();
+        if (n.dot(center_ray) < 0)
+            n = -n;
+        planes_[i] = n;
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void EntityCuller::setPlanarView(const geo::Pose3D& sensor_pose, double angle_min, double angle_max, double max_range,
+                                 bool require_in_plane)
+{
+    pruneBounds();
+
+    sensor_pose_inv_ = sensor_pose.inverse();
+    max_range_ = max_range;
+    looks_along_z_ = false;
+    require_in_plane_ = require_in_plane;
+
+    if (angle_max - angle_min >= 2 * M_PI)
+    {
+        planes_.clear();
+        planes_union_ = false;
+        return;
+    }
+
+    // Inward pointing normals of the wedge boundaries
+    planes_.resize(2);
+    planes_[0] = geo::Vec3(-std::sin(angle_min), std::cos(angle_min), 0);
+    planes_[1] = geo::Vec3(std::sin(angle_max), -std::cos(angle_max), 0);
+
+    planes_union_ = (angle_max - angle_min > M_PI);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void EntityCuller::pruneBounds()
+{
+    for(std::map<ed::UUID, LocalBounds>::iterator it = bounds_.begin(); it != bounds_.end();)
+    {
+        if (it->second.used)
+        {
+            it->second.used = false;
+            ++it;
+        }
+        else
+            bounds_.erase(it++);
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool EntityCuller::getBoundingSphere(const ed::EntityConstPtr& e, geo::Vec3& center, double& radius)
+{
+    if (!e->has_pose())
+        return false;
+
+    return getBoundingSphere(e, e->pose(), center, radius);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool EntityCuller::getBoundingSphere(const ed::EntityConstPtr& e, const geo::Pose3D& pose, geo::Vec3& center, double& radius)
+{
+    if (!e->shape())
+        return false;
+
+    LocalBounds& b = bounds_[e->id()];
+    b.used = true;
+    if (b.shape != e->shape() || b.shape_revision != e->shapeRevision())
+    {
+        b.shape = e->shape();
+        b.shape_revision = e->shapeRevision();
+
+        const std::vector<geo::Vec3>& points = e->shape()->getMesh().getPoints();
+        if (points.empty())
+        {
+            b.center = geo::Vec3(0, 0, 0);
+            b.radius = 0;
+        }
+        else
+        {
+            geo::Vec3 p_min = points[0];
+            geo::Vec3 p_max = points[0];
+            for(std::vector<geo::Vec3>::const_iterator it = points.begin(); it != points.end(); ++it)
+            {
+                p_min.x = std::min(p_min.x, it->x); p_max.x = std::max(p_max.x, it->x);
+                p_min.y = std::min(p_min.y, it->y); p_max.y = std::max(p_max.y, it->y);
+                p_min.z = std::min(p_min.z, it->z); p_max.z = std::max(p_max.z, it->z);
+            }
+
+            b.center = (p_min + p_max) / 2;
+
+            double r2 = 0;
+            for(std::vector<geo::Vec3>::const_iterator it = points.begin(); it != points.end(); ++it)
+                r2 = std::max(r2, (*it - b.center).length2());
+            b.radius = std::sqrt(r2);
+        }
+    }
+
+    center = pose * b.center;
+    radius = b.radius;
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool EntityCuller::isVisible(const ed::EntityConstPtr& e)
+{
+    if (!e->has_pose())
+        return false;
+
+    return isVisible(e, e->pose());
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool EntityCuller::isVisible(const ed::EntityConstPtr& e, const geo::Pose3D& pose)
+{
+    geo::Vec3 center;
+    double r;
+    if (!getBoundingSphere(e, pose, center, r))
+        return false;
+
+    geo::Vec3 c = sensor_pose_inv_ * center;
+
+    if (looks_along_z_)
+    {
+        // Completely behind the camera
+        if (c.z > r)
+            return false;
+
+        if (max_range_ > 0 && -c.z - r > max_range_)
+            return false;
+    }
+    else
+    {
+        if (require_in_plane_ && std::abs(c.z) > r)
+            return false;
+
+        if (max_range_ > 0 && geo::Vec2(c.x, c.y).length() - r > max_range_)
+            return false;
+    }
+
+    if (planes_union_)
+    {
+        // Outside only if completely outside all half spaces
+        for(std::vector<geo::Vec3>::const_iterator it = planes_.begin(); it != planes_.end(); ++it)
+        {
+            if (it->dot(c) >= -r)
+                return true;
+        }
+        return false;
+    }
+
+    for(std::vector<geo::Vec3>::const_iterator it = planes_.begin(); it != planes_.end(); ++it)
+    {
+        if (it->dot(c) < -r)
+            return false;
+    }
+
+    return true;
+}
+
+}
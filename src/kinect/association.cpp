@@ -1,5 +1,6 @@
 #include "ed/kinect/association.h"
 #include "ed/kinect/entity_update.h"
+#include "ed/kinect/frame_context.h"
 
 #include "ed_sensor_integration/association_matrix.h"
 
@@ -15,14 +16,14 @@
 
 // ----------------------------------------------------------------------------------------------------
 
-void associateAndUpdate(const std::vector<ed::EntityConstPtr>& entities, const rgbd::ImageConstPtr& image, const geo::Pose3D& sensor_pose,
+void associateAndUpdate(const std::vector<ed::EntityConstPtr>& entities, const FrameContext& frame,
                         std::vector<EntityUpdate>& clusters, ed::UpdateRequest& req)
 {
     if (clusters.empty())
         return;
 
-    const cv::Mat& depth = image->getDepthImage();
-    rgbd::View view(*image, depth.cols);
+    const rgbd::ImageConstPtr& image = frame.image();
+    const geo::Pose3D& sensor_pose = frame.sensorPose();
 
     std::vector<int> entities_associated;
 
@@ -214,7 +215,7 @@ void associateAndUpdate(const std::vector<ed::EntityConstPtr>& entities, const r
 
         // Create and add measurement
         ed::ImageMask mask;
-        mask.setSize(image->getDepthImage().cols, image->getDepthImage().rows);
+        mask.setSize(frame.depth().cols, frame.depth().rows);
         for(std::vector<unsigned int>::const_iterator it = cluster.pixel_indices.begin(); it != cluster.pixel_indices.end(); ++it)
             mask.addPoint(*it);
 
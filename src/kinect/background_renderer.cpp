@@ -0,0 +1,474 @@
+#include "ed/kinect/background_renderer.h"
+
+#include <geolib/sensors/DepthCamera.h>
+#include <geolib/Shape.h>
+
+#include <ed/world_model.h>
+#include <ed/entity.h>
+
+#include "ed/kinect/parallel.h"
+
+#include <algorithm>
+#include <cmath>
+
+// ----------------------------------------------------------------------------------------------------
+
+namespace
+{
+
+class CachingRenderResult : public geo::RenderResult
+{
+
+public:
+
+    CachingRenderResult(cv::Mat& z_buffer_, cv::Mat& index_buffer_)
+        : geo::RenderResult(z_buffer_.cols, z_buffer_.rows), z_buffer(z_buffer_), index_buffer(index_buffer_)
+    {
+        startEntity(cv::Rect(0, 0, z_buffer.cols, z_buffer.rows), -1);
+    }
+
+    // Only pixels within 'clip_' are written, and labeled with 'index_'. Keeps track of the area touched
+    // by the entity
+    void startEntity(const cv::Rect& clip_, int index_)
+    {
+        clip = clip_;
+        index = index_;
+        x_min = z_buffer.cols;
+        y_min = z_buffer.rows;
+        x_max = -1;
+        y_max = -1;
+    }
+
+    void renderPixel(int x, int y, float depth, int i_triangle)
+    {
+        if (x < clip.x || y < clip.y || x >= clip.x + clip.width || y >= clip.y + clip.height)
+            return;
+
+        x_min = std::min(x_min, x);
+        y_min = std::min(y_min, y);
+        x_max = std::max(x_max, x);
+        y_max = std::max(y_max, y);
+
+        float& old_depth = z_buffer.at<float>(y, x);
+        if (old_depth == 0 || depth < old_depth)
+        {
+            old_depth = depth;
+            index_buffer.at<int>(y, x) = index;
+        }
+    }
+
+    cv::Rect bounds() const
+    {
+        if (x_max < x_min)
+            return cv::Rect();
+        return cv::Rect(x_min, y_min, x_max - x_min + 1, y_max - y_min + 1);
+    }
+
+    cv::Mat& z_buffer;
+    cv::Mat& index_buffer;
+    cv::Rect clip;
+    int index;
+    int x_min, y_min, x_max, y_max;
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+// Renders the entity at the given pose within the clip area and returns the image area it covers
+cv::Rect renderEntity(const ed::Entity& e, const geo::Pose3D& pose, int index, const geo::DepthCamera& cam,
+                      const geo::Pose3D& sensor_pose_inv, const cv::Rect& clip, CachingRenderResult& res)
+{
+    res.startEntity(clip, index);
+
+    geo::RenderOptions opt;
+    opt.setMesh(e.shape()->getMesh(), sensor_pose_inv * pose);
+    cam.render(opt, res);
+
+    return res.bounds();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Renders the entities distributed over the threads, each thread in its own depth and index buffer. Entity
+// i is labeled with index i.
+struct RenderJob
+{
+    RenderJob(const std::vector<ed::EntityConstPtr>& entities_, const WorldOverlay& world_, const geo::DepthCamera& cam_,
+              const geo::Pose3D& sensor_pose_inv_, std::vector<cv::Mat>& buffers_, std::vector<cv::Mat>& index_buffers_,
+              std::vector<cv::Rect>& rects_)
+        : entities(entities_), world(world_), cam(cam_), sensor_pose_inv(sensor_pose_inv_), buffers(buffers_),
+          index_buffers(index_buffers_), rects(rects_) {}
+
+    void operator()(unsigned int i_thread)
+    {
+        cv::Mat& buffer = buffers[i_thread];
+        CachingRenderResult res(buffer, index_buffers[i_thread]);
+        cv::Rect full(0, 0, buffer.cols, buffer.rows);
+
+        for(unsigned int i = i_thread; i < entities.size(); i += buffers.size())
+            rects[i] = renderEntity(*entities[i], world.pose(*entities[i]), i, cam, sensor_pose_inv, full, res);
+    }
+
+    const std::vector<ed::EntityConstPtr>& entities;
+    const WorldOverlay& world;
+    const geo::DepthCamera& cam;
+    const geo::Pose3D& sensor_pose_inv;
+    std::vector<cv::Mat>& buffers;
+    std::vector<cv::Mat>& index_buffers;
+    std::vector<cv::Rect>& rects;
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+// Merges all depth buffers into the first one (min reduction), together with the entity index of the closest
+// depth. Each thread handles a stripe of rows
+struct MergeJob
+{
+    MergeJob(std::vector<cv::Mat>& buffers_, std::vector<cv::Mat>& index_buffers_)
+        : buffers(buffers_), index_buffers(index_buffers_) {}
+
+    void operator()(unsigned int i_thread)
+    {
+        cv::Mat& target = buffers[0];
+
+        unsigned int y_begin, y_end;
+        partitionRange(target.rows, buffers.size(), i_thread, y_begin, y_end);
+
+        for(unsigned int y = y_begin; y < y_end; ++y)
+        {
+            float* d = target.ptr<float>(y);
+            int* index = index_buffers[0].ptr<int>(y);
+            for(unsigned int i = 1; i < buffers.size(); ++i)
+            {
+                const float* d_other = buffers[i].ptr<float>(y);
+                const int* index_other = index_buffers[i].ptr<int>(y);
+                for(int x = 0; x < target.cols; ++x)
+                {
+                    if (d_other[x] > 0 && (d[x] == 0 || d_other[x] < d[x]))
+                    {
+                        d[x] = d_other[x];
+                        index[x] = index_other[x];
+                    }
+                }
+            }
+        }
+    }
+
+    std::vector<cv::Mat>& buffers;
+    std::vector<cv::Mat>& index_buffers;
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+bool equalPoses(const geo::Pose3D& p1, const geo::Pose3D& p2)
+{
+    return p1.t.x == p2.t.x && p1.t.y == p2.t.y && p1.t.z == p2.t.z
+            && p1.R.xx == p2.R.xx && p1.R.xy == p2.R.xy && p1.R.xz == p2.R.xz
+            && p1.R.yx == p2.R.yx && p1.R.yy == p2.R.yy && p1.R.yz == p2.R.yz
+            && p1.R.zx == p2.R.zx && p1.R.zy == p2.R.zy && p1.R.zz == p2.R.zz;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+cv::Rect unite(const cv::Rect& r1, const cv::Rect& r2)
+{
+    if (r1.area() == 0)
+        return r2;
+    if (r2.area() == 0)
+        return r1;
+    return r1 | r2;
+}
+
+} // end unnamed namespace
+
+// ----------------------------------------------------------------------------------------------------
+
+BackgroundRenderer::BackgroundRenderer() : fx_(0), fy_(0), cx_(0), cy_(0), max_translation_(0.002), max_rotation_(0.002),
+    num_threads_(1)
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+BackgroundRenderer::~BackgroundRenderer()
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void BackgroundRenderer::setSensorPoseTolerance(double max_translation, double max_rotation)
+{
+    max_translation_ = max_translation;
+    max_rotation_ = max_rotation;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void BackgroundRenderer::clear()
+{
+    depth_ = cv::Mat();
+    entity_index_ = cv::Mat();
+    entities_.clear();
+    entity_ids_.clear();
+    free_indices_.clear();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool BackgroundRenderer::isValid(const geo::DepthCamera& cam, const geo::Pose3D& sensor_pose, int width, int height) const
+{
+    if (depth_.cols != width || depth_.rows != height)
+        return false;
+
+    if (cam.getFocalLengthX() != fx_ || cam.getFocalLengthY() != fy_
+            || cam.getOpticalCenterX() != cx_ || cam.getOpticalCenterY() != cy_)
+        return false;
+
+    geo::Pose3D delta = sensor_pose_.inverse() * sensor_pose;
+
+    // Rotation angle of the delta rotation matrix
+    double c = std::max(-1.0, std::min(1.0, (delta.R.xx + delta.R.yy + delta.R.zz - 1) / 2));
+
+    return delta.t.length() <= max_translation_ && std::acos(c) <= max_rotation_;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+int BackgroundRenderer::getEntityIndex(const ed::EntityConstPtr& e)
+{
+    std::map<ed::UUID, CachedEntity>::const_iterator it = entities_.find(e->id());
+    if (it != entities_.end() && it->second.index >= 0)
+        return it->second.index;
+
+    if (!free_indices_.empty())
+    {
+        int index = free_indices_.back();
+        free_indices_.pop_back();
+        entity_ids_[index] = e->id();
+        return index;
+    }
+
+    entity_ids_.push_back(e->id());
+    return entity_ids_.size() - 1;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void BackgroundRenderer::releaseEntityIndex(const ed::EntityConstPtr& e)
+{
+    std::map<ed::UUID, CachedEntity>::const_iterator it = entities_.find(e->id());
+    if (it != entities_.end() && it->second.index >= 0)
+        free_indices_.push_back(it->second.index);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void BackgroundRenderer::updateCachedEntity(const ed::EntityConstPtr& e, const geo::Pose3D& pose, const cv::Rect& rect, int index)
+{
+    CachedEntity& c = entities_[e->id()];
+    c.shape = e->shape();
+    c.shape_revision = e->shapeRevision();
+    c.pose = pose;
+    c.rect = rect;
+    c.index = index;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void BackgroundRenderer::renderAll(const WorldOverlay& world, const geo::DepthCamera& cam)
+{
+    // Entities outside the camera frustum do not need to be rasterized
+    std::vector<ed::EntityConstPtr> visible_entities;
+    for(ed::WorldModel::const_iterator it = world.world().begin(); it != world.world().end(); ++it)
+    {
+        const ed::EntityConstPtr& e = *it;
+        if (!e->shape() || !world.hasPose(*e))
+            continue;
+
+        if (culler_.isVisible(e, world.pose(*e)))
+            visible_entities.push_back(e);
+        else
+            updateCachedEntity(e, world.pose(*e), cv::Rect(), -1);
+    }
+
+    // The visible entities are labeled with their index in this list
+    entity_ids_.resize(visible_entities.size());
+    free_indices_.clear();
+    for(unsigned int i = 0; i < visible_entities.size(); ++i)
+        entity_ids_[i] = visible_entities[i]->id();
+
+    unsigned int num_threads = std::max(1u, std::min<unsigned int>(num_threads_, visible_entities.size()));
+
+    thread_buffers_.resize(num_threads);
+    thread_index_buffers_.resize(num_threads);
+    thread_buffers_[0] = depth_;
+    thread_index_buffers_[0] = entity_index_;
+    for(unsigned int i = 1; i < num_threads; ++i)
+    {
+        cv::Mat& buffer = thread_buffers_[i];
+        cv::Mat& index_buffer = thread_index_buffers_[i];
+        if (buffer.rows != depth_.rows || buffer.cols != depth_.cols)
+        {
+            buffer = cv::Mat(depth_.rows, depth_.cols, CV_32FC1, 0.0);
+            index_buffer = cv::Mat(depth_.rows, depth_.cols, CV_32SC1, -1);
+        }
+        else
+        {
+            buffer.setTo(0.0);
+            index_buffer.setTo(-1);
+        }
+    }
+
+    std::vector<cv::Rect> rects(visible_entities.size());
+
+    RenderJob render_job(visible_entities, world, cam, sensor_pose_.inverse(), thread_buffers_, thread_index_buffers_, rects);
+    runParallel(num_threads, render_job);
+
+    if (num_threads > 1)
+    {
+        MergeJob merge_job(thread_buffers_, thread_index_buffers_);
+        runParallel(num_threads, merge_job);
+    }
+
+    for(unsigned int i = 0; i < visible_entities.size(); ++i)
+        updateCachedEntity(visible_entities[i], world.pose(*visible_entities[i]), rects[i], i);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+const cv::Mat& BackgroundRenderer::render(const WorldOverlay& world, const geo::DepthCamera& cam, const geo::Pose3D& sensor_pose,
+                                          int width, int height)
+{
+    if (!isValid(cam, sensor_pose, width, height))
+    {
+        // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+        // Sensor moved (or first render): render everything
+
+        depth_ = cv::Mat(height, width, CV_32FC1, 0.0);
+        entity_index_ = cv::Mat(height, width, CV_32SC1, -1);
+        entities_.clear();
+        entity_ids_.clear();
+        free_indices_.clear();
+
+        sensor_pose_ = sensor_pose;
+        fx_ = cam.getFocalLengthX();
+        fy_ = cam.getFocalLengthY();
+        cx_ = cam.getOpticalCenterX();
+        cy_ = cam.getOpticalCenterY();
+
+        culler_.setDepthCameraView(cam, width, height, sensor_pose_);
+
+        renderAll(world, cam);
+
+        ++stats_.misses;
+        return depth_;
+    }
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // Determine which entities changed since the last render, and which image area they covered
+
+    for(std::map<ed::UUID, CachedEntity>::iterator it = entities_.begin(); it != entities_.end(); ++it)
+        it->second.seen = false;
+
+    std::vector<ed::EntityConstPtr> changed_entities;
+    cv::Rect dirty;
+
+    for(ed::WorldModel::const_iterator it = world.world().begin(); it != world.world().end(); ++it)
+    {
+        const ed::EntityConstPtr& e = *it;
+        if (!e->shape() || !world.hasPose(*e))
+            continue;
+
+        std::map<ed::UUID, CachedEntity>::iterator it_cached = entities_.find(e->id());
+        if (it_cached == entities_.end())
+        {
+            changed_entities.push_back(e);
+            continue;
+        }
+
+        CachedEntity& c = it_cached->second;
+        c.seen = true;
+
+        if (c.shape != e->shape() || c.shape_revision != e->shapeRevision() || !equalPoses(c.pose, world.pose(*e)))
+        {
+            changed_entities.push_back(e);
+            dirty = unite(dirty, c.rect);
+        }
+    }
+
+    // Entities that were removed from the world model
+    for(std::map<ed::UUID, CachedEntity>::iterator it = entities_.begin(); it != entities_.end();)
+    {
+        if (!it->second.seen)
+        {
+            // Its pixels are within its area, which is cleared below, so the index can be reused
+            dirty = unite(dirty, it->second.rect);
+            if (it->second.index >= 0)
+                free_indices_.push_back(it->second.index);
+            entities_.erase(it++);
+        }
+        else
+            ++it;
+    }
+
+    if (changed_entities.empty() && dirty.area() == 0)
+    {
+        ++stats_.hits;
+        return depth_;
+    }
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // Clear the area previously covered by the changed entities, and re-render the unchanged
+    // entities that overlap with that area
+
+    // Render from the sensor pose of the cached render, not the current one (the difference is within the tolerance):
+    // otherwise the re-rendered part would not line up with the rest of the cached render
+    geo::Pose3D sensor_pose_inv = sensor_pose_.inverse();
+    CachingRenderResult res(depth_, entity_index_);
+
+    if (dirty.area() > 0)
+    {
+        depth_(dirty).setTo(0.0);
+        entity_index_(dirty).setTo(-1);
+
+        for(ed::WorldModel::const_iterator it = world.world().begin(); it != world.world().end(); ++it)
+        {
+            const ed::EntityConstPtr& e = *it;
+            if (!e->shape() || !world.hasPose(*e))
+                continue;
+
+            std::map<ed::UUID, CachedEntity>::const_iterator it_cached = entities_.find(e->id());
+            if (it_cached == entities_.end() || (it_cached->second.rect & dirty).area() == 0)
+                continue;
+
+            if (std::find(changed_entities.begin(), changed_entities.end(), e) != changed_entities.end())
+                continue;
+
+            // Only the dirty area is re-rendered, so the cached entity area stays as it is
+            renderEntity(*e, world.pose(*e), it_cached->second.index, cam, sensor_pose_inv, dirty, res);
+        }
+    }
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // Render the changed entities with their new shape and pose
+
+    cv::Rect full(0, 0, width, height);
+    for(std::vector<ed::EntityConstPtr>::const_iterator it = changed_entities.begin(); it != changed_entities.end(); ++it)
+    {
+        const ed::EntityConstPtr& e = *it;
+        const geo::Pose3D& pose = world.pose(*e);
+        if (culler_.isVisible(e, pose))
+        {
+            int index = getEntityIndex(e);
+            updateCachedEntity(e, pose, renderEntity(*e, pose, index, cam, sensor_pose_inv, full, res), index);
+        }
+        else
+        {
+            // Its previous area was cleared, so it no longer occurs in the index image
+            releaseEntityIndex(e);
+            updateCachedEntity(e, pose, cv::Rect(), -1);
+        }
+    }
+
+    ++stats_.partial_hits;
+    return depth_;
+}
@@ -25,9 +25,27 @@ void BeamModel::initialize(double w, unsigned int num_beams)
 
 // ----------------------------------------------------------------------------------------------------
 
-void BeamModel::RenderModel(const std::vector<std::vector<geo::Vec2> >& contours, const geo::Transform2& pose, int identifier,
-                            std::vector<double>& ranges, std::vector<int>& identifiers) const
+namespace
 {
+
+// Only translates the points (for contours that are already rotated)
+struct Translation
+{
+    Translation(const geo::Vec2& t_) : t(t_) {}
+
+    geo::Vec2 operator*(const geo::Vec2& p) const { return p + t; }
+
+    const geo::Vec2& t;
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+template<typename Transform>
+void renderModel(const BeamModel& beam_model, const std::vector<std::vector<geo::Vec2> >& contours, const Transform& pose,
+                 int identifier, std::vector<double>& ranges, std::vector<int>& identifiers)
+{
+    const std::vector<geo::Vec2>& rays = beam_model.rays();
+
     double near_plane = 0.01;
 
     geo::Vec2 p1_temp, p2_temp;
@@ -35,18 +53,25 @@ void BeamModel::RenderModel(const std::vector<std::vector<geo::Vec2> >& contours
     for(std::vector<std::vector<geo::Vec2> >::const_iterator it_contour = contours.begin(); it_contour != contours.end(); ++it_contour)
     {
         const std::vector<geo::Vec2>& model = *it_contour;
+        if (model.empty())
+            continue;
 
-        std::vector<geo::Vec2> t_vertices(model.size());
-        for(unsigned int i = 0; i < model.size(); ++i)
-            t_vertices[i] = pose * model[i];
+        int nbeams = beam_model.num_beams();
 
-        int nbeams = num_beams();
+        // Vertices are transformed on the fly (each once), such that nothing needs to be allocated
+        const geo::Vec2 t_first = pose * model[0];
+        geo::Vec2 t_next = t_first;
 
         for(unsigned int i = 0; i < model.size(); ++i)
         {
             unsigned int j = (i + 1) % model.size();
-            const geo::Vec2* p1 = &t_vertices[i];
-            const geo::Vec2* p2 = &t_vertices[j];
+
+            geo::Vec2 t1 = t_next;
+            t_next = (j == 0) ? t_first : pose * model[j];
+            geo::Vec2 t2 = t_next;
+
+            const geo::Vec2* p1 = &t1;
+            const geo::Vec2* p2 = &t2;
 
             // If p1 is behind the near plane, clip it
             if (p1->y < near_plane)
@@ -71,8 +96,8 @@ void BeamModel::RenderModel(const std::vector<std::vector<geo::Vec2> >& contours
             }
 
             // Calculate the beam numbers corresponding to p1 and p2
-            int i1 = CalculateBeam(p1->x, p1->y) + 1;
-            int i2 = CalculateBeam(p2->x, p2->y);
+            int i1 = beam_model.CalculateBeam(p1->x, p1->y) + 1;
+            int i2 = beam_model.CalculateBeam(p2->x, p2->y);
 
             // If i2 < i1, we are looking at the back face of the line, so skip it (back face culling)
             // If i2 < 0 or i1 >= nbeams, the whole line is out of view, so skip it
@@ -88,7 +113,7 @@ void BeamModel::RenderModel(const std::vector<std::vector<geo::Vec2> >& contours
 
             for(int i_beam = i1; i_beam <= i2; ++i_beam)
             {
-                const geo::Vec2& r = rays_[i_beam];
+                const geo::Vec2& r = rays[i_beam];
 
                 // calculate depth of intersection between line (p1, p2) and r
                 double d =  t / (r.x * s.y - r.y * s.x);
@@ -104,3 +129,95 @@ void BeamModel::RenderModel(const std::vector<std::vector<geo::Vec2> >& contours
     }
 }
 
+// ----------------------------------------------------------------------------------------------------
+
+template<typename Transform>
+double renderBeam(const BeamModel& beam_model, const std::vector<std::vector<geo::Vec2> >& contours, const Transform& pose,
+                  int i_beam)
+{
+    double near_plane = 0.01;
+
+    const geo::Vec2& r = beam_model.rays()[i_beam];
+    double depth = 0;
+
+    for(std::vector<std::vector<geo::Vec2> >::const_iterator it_contour = contours.begin(); it_contour != contours.end(); ++it_contour)
+    {
+        const std::vector<geo::Vec2>& model = *it_contour;
+        if (model.empty())
+            continue;
+
+        const geo::Vec2 t_first = pose * model[0];
+        geo::Vec2 t_next = t_first;
+
+        for(unsigned int i = 0; i < model.size(); ++i)
+        {
+            unsigned int j = (i + 1) % model.size();
+
+            geo::Vec2 p1 = t_next;
+            t_next = (j == 0) ? t_first : pose * model[j];
+            geo::Vec2 p2 = t_next;
+
+            // Near plane clipping, as in renderModel()
+            if (p1.y < near_plane)
+            {
+                if (p2.y < near_plane)
+                    continue;
+
+                double f = (near_plane - p1.y) / (p2.y - p1.y);
+                p1.x = p1.x + f * (p2.x - p1.x);
+                p1.y = near_plane;
+            }
+            else if (p2.y < near_plane)
+            {
+                double f = (near_plane - p2.y) / (p1.y - p2.y);
+                p2.x = p2.x + f * (p1.x - p2.x);
+                p2.y = near_plane;
+            }
+
+            // Only lines of which the beam range contains the beam (this also culls back faces)
+            if (i_beam < beam_model.CalculateBeam(p1.x, p1.y) + 1 || i_beam > beam_model.CalculateBeam(p2.x, p2.y))
+                continue;
+
+            geo::Vec2 s = p2 - p1;
+            double t = p1.x * s.y - p1.y * s.x;
+
+            double d = t / (r.x * s.y - r.y * s.x);
+            if (d > 0 && (d < depth || depth == 0))
+                depth = d;
+        }
+    }
+
+    return depth;
+}
+
+} // end anonymous namespace
+
+// ----------------------------------------------------------------------------------------------------
+
+void BeamModel::RenderModel(const std::vector<std::vector<geo::Vec2> >& contours, const geo::Transform2& pose, int identifier,
+                            std::vector<double>& ranges, std::vector<int>& identifiers) const
+{
+    renderModel(*this, contours, pose, identifier, ranges, identifiers);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void BeamModel::RenderModel(const std::vector<std::vector<geo::Vec2> >& contours, const geo::Vec2& translation, int identifier,
+                            std::vector<double>& ranges, std::vector<int>& identifiers) const
+{
+    renderModel(*this, contours, Translation(translation), identifier, ranges, identifiers);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+double BeamModel::RenderBeam(const std::vector<std::vector<geo::Vec2> >& contours, const geo::Transform2& pose, int i_beam) const
+{
+    return renderBeam(*this, contours, pose, i_beam);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+double BeamModel::RenderBeam(const std::vector<std::vector<geo::Vec2> >& contours, const geo::Vec2& translation, int i_beam) const
+{
+    return renderBeam(*this, contours, Translation(translation), i_beam);
+}
@@ -0,0 +1,60 @@
+#include "ed/kinect/distance_field.h"
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <algorithm>
+
+// ----------------------------------------------------------------------------------------------------
+
+DistanceField2D::DistanceField2D() : resolution_(1), margin_(0)
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+DistanceField2D::~DistanceField2D()
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void DistanceField2D::calculate(const std::vector<geo::Vec2>& points, double resolution, double margin)
+{
+    resolution_ = resolution;
+    margin_ = margin;
+
+    if (points.empty())
+    {
+        field_ = cv::Mat();
+        return;
+    }
+
+    geo::Vec2 p_min(1e9, 1e9);
+    geo::Vec2 p_max(-1e9, -1e9);
+    for(std::vector<geo::Vec2>::const_iterator it = points.begin(); it != points.end(); ++it)
+    {
+        p_min.x = std::min(p_min.x, it->x);
+        p_min.y = std::min(p_min.y, it->y);
+        p_max.x = std::max(p_max.x, it->x);
+        p_max.y = std::max(p_max.y, it->y);
+    }
+
+    origin_ = geo::Vec2(p_min.x - margin, p_min.y - margin);
+
+    int cols = (p_max.x - p_min.x + 2 * margin) / resolution + 1;
+    int rows = (p_max.y - p_min.y + 2 * margin) / resolution + 1;
+
+    // Points are the zero pixels of the distance transform. If the field is calculated again with the same size
+    // (e.g., FitterData kept between frames), the buffers are reused.
+    mask_.create(rows, cols, CV_8UC1);
+    mask_.setTo(255);
+    for(std::vector<geo::Vec2>::const_iterator it = points.begin(); it != points.end(); ++it)
+    {
+        int x = (it->x - origin_.x) / resolution;
+        int y = (it->y - origin_.y) / resolution;
+        mask_.at<unsigned char>(y, x) = 0;
+    }
+
+    cv::distanceTransform(mask_, field_, CV_DIST_L2, CV_DIST_MASK_PRECISE);
+    field_ *= resolution;
+}
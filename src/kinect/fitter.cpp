@@ -22,9 +22,12 @@
 // 2D model creation
 #include "ed/kinect/mesh_tools.h"
 
+#include "ed/kinect/parallel.h"
+
 // Communication
 #include "ed_sensor_integration/ImageBinary.h"
 
+#include <algorithm>
 #include <iostream>
 
 // ----------------------------------------------------------------------------------------------------
@@ -54,7 +57,692 @@ geo::Transform2 XYYawToTransform2(const geo::Pose3D& pose)
 
 // ----------------------------------------------------------------------------------------------------
 
-Fitter::Fitter()
+namespace
+{
+
+// Error of a beam with a measured range (ds > 0), given the range of the model (dm, or 0 if nothing is rendered)
+inline double beamError(double ds, double dm)
+{
+    if (dm <= 0)
+        return 0.1;
+
+    double diff = std::abs(ds - dm);
+    if (diff < 0.1)
+        return diff;
+
+    return ds > dm ? 1 : 0.1;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Point on the contour of a shape, with the direction of its contour edge
+struct ContourSample
+{
+    geo::Vec2 p;
+    geo::Vec2 dir;
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+// Samples the edges of the contours with the given (maximum) spacing
+void sampleContours(const Shape2D& shape, double spacing, std::vector<ContourSample>& samples)
+{
+    samples.clear();
+    for(unsigned int i = 0; i < shape.size(); ++i)
+    {
+        const std::vector<geo::Vec2>& contour = shape[i];
+        for(unsigned int j = 0; j < contour.size(); ++j)
+        {
+            const geo::Vec2& p1 = contour[j];
+            geo::Vec2 s = contour[(j + 1) % contour.size()] - p1;
+
+            int n = std::max(1.0, ceil(s.length() / spacing));
+
+            ContourSample sample;
+            sample.dir = s;
+            for(int k = 0; k < n; ++k)
+            {
+                sample.p = p1 + s * ((k + 0.5) / n);
+                samples.push_back(sample);
+            }
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// The shape and its contour samples, rotated with each of the candidate yaws. Candidates with the same yaw then only
+// need to translate them.
+struct RotatedShapes
+{
+    RotatedShapes(const Shape2D& shape, const std::vector<ContourSample>& samples_in, const std::vector<double>& yaws)
+        : rotations(yaws.size()), shapes(yaws.size(), shape), samples(yaws.size(), samples_in)
+    {
+        for(unsigned int i_yaw = 0; i_yaw < yaws.size(); ++i_yaw)
+        {
+            double cos_alpha = cos(yaws[i_yaw]);
+            double sin_alpha = sin(yaws[i_yaw]);
+            rotations[i_yaw] = geo::Mat2(cos_alpha, -sin_alpha, sin_alpha, cos_alpha);
+            const geo::Mat2& rot = rotations[i_yaw];
+
+            Shape2D& rotated_shape = shapes[i_yaw];
+            for(unsigned int i = 0; i < rotated_shape.size(); ++i)
+            {
+                std::vector<geo::Vec2>& contour = rotated_shape[i];
+                for(unsigned int j = 0; j < contour.size(); ++j)
+                    contour[j] = rot * contour[j];
+            }
+
+            std::vector<ContourSample>& rotated_samples = samples[i_yaw];
+            for(unsigned int i = 0; i < rotated_samples.size(); ++i)
+            {
+                rotated_samples[i].p = rot * rotated_samples[i].p;
+                rotated_samples[i].dir = rot * rotated_samples[i].dir;
+            }
+        }
+    }
+
+    std::vector<geo::Mat2> rotations;
+    std::vector<Shape2D> shapes;
+
+    // Only used with distance field scoring
+    std::vector<std::vector<ContourSample> > samples;
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+// The candidate poses of a shape: the shape is rotated with a yaw (by index in the rotated shapes), and placed on a
+// beam such that it touches the measured range of that beam. Holds its own scratch buffers, so a copy per thread can
+// be used concurrently.
+struct PoseCandidates
+{
+    PoseCandidates(const BeamModel& beam_model_, const Shape2D& shape_, const RotatedShapes& rotated_,
+                   const std::vector<double>& sensor_ranges_, const std::vector<double>& model_ranges_, int expected_center_beam_)
+        : beam_model(beam_model_), shape(shape_), rotated(rotated_), sensor_ranges(sensor_ranges_), model_ranges(model_ranges_),
+          expected_center_beam(expected_center_beam_), test_ranges(sensor_ranges_.size(), 0),
+          identifiers(sensor_ranges_.size(), 0), num_measured(0)
+    {
+        // Cumulative error and number of the measured beams, without the shape
+        error_sums.resize(sensor_ranges.size() + 1, 0);
+        measured_sums.resize(sensor_ranges.size() + 1, 0);
+        for(unsigned int i = 0; i < sensor_ranges.size(); ++i)
+        {
+            double ds = sensor_ranges[i];
+            error_sums[i + 1] = error_sums[i] + (ds > 0 ? beamError(ds, model_ranges[i]) : 0);
+            measured_sums[i + 1] = measured_sums[i] + (ds > 0 ? 1 : 0);
+        }
+
+        num_measured = measured_sums.back();
+    }
+
+    // Error of the measured beams outside [i_min, i_max] without the shape, averaged over all measured beams. This is a
+    // lower bound on the error of a candidate that only covers beams [i_min, i_max].
+    double errorOutside(int i_min, int i_max) const
+    {
+        return (error_sums.back() - (error_sums[i_max + 1] - error_sums[i_min])) / num_measured;
+    }
+
+    // Returns false if the beam has no measurement, or the shape can not be placed on it
+    bool place(int i_beam, int i_yaw, geo::Transform2& pose) const
+    {
+        double l = beam_model.rays()[i_beam].length();
+        geo::Vec2 r = beam_model.rays()[i_beam] / l;
+
+        pose = geo::Transform2(rotated.rotations[i_yaw], r * 10);
+
+        // ----------------
+        // Determine initial pose based on measured range
+
+        double ds = sensor_ranges[i_beam];
+        double dm = beam_model.RenderBeam(rotated.shapes[i_yaw], pose.t, i_beam);
+
+        if (ds <= 0 || dm <= 0)
+            return false;
+
+        pose.t += r * ((ds - dm) * l);
+        return true;
+    }
+
+    // Average error over the measured beams, with the shape rendered at the given pose into the rest of the world
+    // model. Returns false if the shape does not cover the expected center beam.
+    bool score(const geo::Transform2& pose, double& error)
+    {
+        test_ranges = model_ranges;
+        identifiers.assign(sensor_ranges.size(), 0);
+        beam_model.RenderModel(shape, pose, 1, test_ranges, identifiers);
+
+        return calculateError(error);
+    }
+
+    // Same as above, for a candidate with the given yaw (index) and translation
+    bool score(int i_yaw, const geo::Vec2& t, double& error)
+    {
+        test_ranges = model_ranges;
+        identifiers.assign(sensor_ranges.size(), 0);
+        beam_model.RenderModel(rotated.shapes[i_yaw], t, 1, test_ranges, identifiers);
+
+        return calculateError(error);
+    }
+
+    // Error of the rendered ranges
+    bool calculateError(double& error) const
+    {
+        if (identifiers[expected_center_beam] != 1)  // expected center beam MUST contain the rendered model
+            return false;
+
+        // ----------------
+        // Calculate error
+
+        double total_error = 0;
+        for(unsigned int i = 0; i < test_ranges.size(); ++i)
+        {
+            double ds = sensor_ranges[i];
+            if (ds > 0)
+                total_error += beamError(ds, test_ranges[i]);
+        }
+
+        error = total_error / num_measured;
+        return true;
+    }
+
+    const BeamModel& beam_model;
+    const Shape2D& shape;
+    const RotatedShapes& rotated;
+    const std::vector<double>& sensor_ranges;
+    const std::vector<double>& model_ranges;
+    int expected_center_beam;
+
+    // Scratch buffers
+    std::vector<double> test_ranges;
+    std::vector<int> identifiers;
+
+    std::vector<double> error_sums;
+    std::vector<int> measured_sums;
+    int num_measured;
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+// Best candidate of a search (or a part of it). Candidates are identified by their index in the exhaustive order
+// (beam-major), which breaks ties between equal errors. Therefore, the best candidate does not depend on the order in
+// which the candidates are evaluated, or on how the search is split over threads.
+struct SearchResult
+{
+    SearchResult() : error(1e9), index(-1) {}
+
+    void update(double error_, int index_, const geo::Transform2& pose_)
+    {
+        if (error_ < error || (error_ == error && index_ < index))
+        {
+            error = error_;
+            index = index_;
+            pose = pose_;
+        }
+    }
+
+    double error;
+    int index;
+    geo::Transform2 pose;
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+// Evaluates every candidate on the beams of part 'i_part' of 'num_parts' (interleaved)
+void searchExhaustive(PoseCandidates& candidates, int beam_step, const std::vector<double>& yaws,
+                      unsigned int i_part, unsigned int num_parts, SearchResult& result)
+{
+    for(int i_beam = i_part * beam_step; i_beam < candidates.sensor_ranges.size(); i_beam += num_parts * beam_step)
+    {
+        for(unsigned int i_yaw = 0; i_yaw < yaws.size(); ++i_yaw)
+        {
+            geo::Transform2 pose;
+            double error;
+            if (!candidates.place(i_beam, i_yaw, pose) || !candidates.score(i_yaw, pose.t, error))
+                continue;
+
+            result.update(error, i_beam * yaws.size() + i_yaw, pose);
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Beam of the ray with the given angle to the y-axis. Clamped, such that rays outside the field of view
+// do not overflow the beam index.
+int beamOfAngle(const BeamModel& beam_model, double angle)
+{
+    return beam_model.CalculateBeam(std::max(-1e3, std::min(1e3, tan(angle))), 1);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Branch-and-bound over the same candidates as searchExhaustive(), with the same result: ties are broken in favor
+// of the candidate that comes first in the exhaustive order. A candidate can only change the error of the beams it
+// covers, so the error of the other beams is a lower bound on its error (see errorOutside()). This is used on two
+// levels:
+//
+//   - per beam (all yaws at once), using the circle around the shape: the placed shape touches the measured point,
+//     so its origin lies within the circle radius of that point, and the shape within the circle around the origin;
+//   - per placed candidate, using the beams covered by its vertices. This avoids rendering and scoring it.
+//
+// The candidates are not a free grid of translations but are tied to the beams, so there is no multi-resolution
+// hierarchy of translation cells to bound; the beam is the coarse level and the placed candidate the fine level.
+//
+// Beams are visited in order of their bound, such that a good candidate is found early, and the search can stop as
+// soon as the bound of a beam exceeds the best error. If the search is split, each part prunes with its own best
+// error. That is never lower than the overall best error, so the result stays the same.
+
+// Calculates the bound per beam, sorted on bound
+void boundBeams(const PoseCandidates& candidates, int beam_step, std::vector<std::pair<double, int> >& beam_bounds)
+{
+    const BeamModel& beam_model = candidates.beam_model;
+    const std::vector<double>& sensor_ranges = candidates.sensor_ranges;
+    int num_beams = sensor_ranges.size();
+    int expected_center_beam = candidates.expected_center_beam;
+
+    // Radius of the circle around the shape origin that contains the shape
+    double radius = 0;
+    for(unsigned int i = 0; i < candidates.shape.size(); ++i)
+    {
+        const std::vector<geo::Vec2>& contour = candidates.shape[i];
+        for(unsigned int j = 0; j < contour.size(); ++j)
+            radius = std::max(radius, contour[j].length());
+    }
+
+    beam_bounds.clear();
+    for(int i_beam = 0; i_beam < num_beams; i_beam += beam_step)
+    {
+        double ds = sensor_ranges[i_beam];
+        if (ds <= 0)
+            continue;
+
+        const geo::Vec2& ray = beam_model.rays()[i_beam];
+
+        // The shape touches the measured point, so its origin lies within 'radius' of that point, and is at least
+        // 'dist' away from the sensor
+        double d_point = ds * ray.length();
+        double dist = d_point - radius;
+
+        int i_min = 0;
+        int i_max = num_beams - 1;
+
+        if (dist > radius)
+        {
+            // Angle of the origin w.r.t. the measured point, plus the angle of the shape w.r.t. its origin
+            double angle = atan2(ray.x, ray.y);
+            double spread = asin(radius / d_point) + asin(radius / dist);
+
+            // One beam margin on both sides, for rounding
+            if (angle - spread > -M_PI / 2)
+                i_min = std::max(i_min, beamOfAngle(beam_model, angle - spread) - 1);
+            if (angle + spread < M_PI / 2)
+                i_max = std::min(i_max, beamOfAngle(beam_model, angle + spread) + 1);
+        }
+
+        if (expected_center_beam < i_min || expected_center_beam > i_max)
+            continue;
+
+        beam_bounds.push_back(std::make_pair(candidates.errorOutside(i_min, i_max), i_beam));
+    }
+
+    std::sort(beam_bounds.begin(), beam_bounds.end());
+}
+
+// Searches the beams of part 'i_part' of 'num_parts' (interleaved over the sorted beams)
+void searchBranchAndBound(PoseCandidates& candidates, const std::vector<std::pair<double, int> >& beam_bounds,
+                          const std::vector<double>& yaws, unsigned int i_part, unsigned int num_parts, SearchResult& result)
+{
+    const BeamModel& beam_model = candidates.beam_model;
+    int num_beams = candidates.sensor_ranges.size();
+    int expected_center_beam = candidates.expected_center_beam;
+
+    // Bounds are only used to skip candidates if they are clearly worse, to stay insensitive to rounding
+    double tolerance = 1e-9;
+
+    double near_plane = 0.01;
+
+    for(unsigned int k = i_part; k < beam_bounds.size(); k += num_parts)
+    {
+        if (beam_bounds[k].first > result.error + tolerance)
+            break;  // Beams are sorted on their bound, so all remaining beams are worse
+
+        int i_beam = beam_bounds[k].second;
+
+        for(unsigned int i_yaw = 0; i_yaw < yaws.size(); ++i_yaw)
+        {
+            geo::Transform2 pose;
+            if (!candidates.place(i_beam, i_yaw, pose))
+                continue;
+
+            // Beams covered by the vertices of the placed shape. If a vertex lies behind the near plane, the shape is
+            // clipped, and no tighter range than all beams can be given.
+            const Shape2D& rotated_shape = candidates.rotated.shapes[i_yaw];
+            int i_min = num_beams;
+            int i_max = -1;
+            for(unsigned int i = 0; i < rotated_shape.size() && i_min >= 0; ++i)
+            {
+                const std::vector<geo::Vec2>& contour = rotated_shape[i];
+                for(unsigned int j = 0; j < contour.size(); ++j)
+                {
+                    geo::Vec2 p = contour[j] + pose.t;
+                    if (p.y < near_plane)
+                    {
+                        i_min = -1;
+                        i_max = num_beams;
+                        break;
+                    }
+
+                    int i_p = beam_model.CalculateBeam(p.x, p.y);
+                    i_min = std::min(i_min, i_p);
+                    i_max = std::max(i_max, i_p);
+                }
+            }
+
+            i_min = std::max(0, i_min - 1);
+            i_max = std::min(num_beams - 1, i_max + 1);
+
+            if (expected_center_beam < i_min || expected_center_beam > i_max)
+                continue;
+
+            if (candidates.errorOutside(i_min, i_max) > result.error + tolerance)
+                continue;
+
+            double error;
+            if (!candidates.score(i_yaw, pose.t, error))
+                continue;
+
+            result.update(error, i_beam * yaws.size() + i_yaw, pose);
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Approximation of the beam error of a candidate, without rendering it. The error of the beams covered by the visible
+// contour samples is estimated from the samples, with the same error per sample as beamError(), but with the distance
+// to the closest measured point instead of the range difference. Samples that are further away than the measured
+// range of their beam count as occluded. The other beams keep the error they have without the shape. Returns false if
+// the visible samples do not cover the expected center beam. The samples must already be rotated; they are only
+// translated.
+bool scoreDistanceField(const PoseCandidates& candidates, const DistanceField2D& field, const std::vector<ContourSample>& samples,
+                        const geo::Vec2& t, double& error)
+{
+    const BeamModel& beam_model = candidates.beam_model;
+    int num_beams = candidates.sensor_ranges.size();
+    double near_plane = 0.01;
+
+    int n = 0;
+    double total_error = 0;
+    int i_min = num_beams;
+    int i_max = -1;
+
+    for(std::vector<ContourSample>::const_iterator it = samples.begin(); it != samples.end(); ++it)
+    {
+        geo::Vec2 p = it->p + t;
+        if (p.y < near_plane)
+            continue;
+
+        // Back face culling, as in the beam model
+        const geo::Vec2& dir = it->dir;
+        if (p.x * dir.y - p.y * dir.x >= 0)
+            continue;
+
+        int i = beam_model.CalculateBeam(p.x, p.y);
+        if (i < 0 || i >= num_beams)
+            continue;
+
+        i_min = std::min(i_min, i);
+        i_max = std::max(i_max, i);
+        ++n;
+
+        double ds = candidates.sensor_ranges[i];
+        if (ds <= 0)
+        {
+            total_error += 0.1;
+            continue;
+        }
+
+        double dist = field.distance(p);
+        if (dist < 0.1)
+            total_error += dist;
+        else if (p.y < ds)
+            total_error += 1;
+        else
+            total_error += 0.1;
+    }
+
+    if (n == 0 || candidates.expected_center_beam < i_min || candidates.expected_center_beam > i_max)
+        return false;
+
+    int num_covered = candidates.measured_sums[i_max + 1] - candidates.measured_sums[i_min];
+    error = candidates.errorOutside(i_min, i_max) + (total_error / n) * num_covered / candidates.num_measured;
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Evaluates every candidate on the beams of part 'i_part' of 'num_parts' (interleaved) with distance field scoring
+void searchDistanceField(PoseCandidates& candidates, const DistanceField2D& field, int beam_step, const std::vector<double>& yaws,
+                         unsigned int i_part, unsigned int num_parts, SearchResult& result)
+{
+    for(int i_beam = i_part * beam_step; i_beam < candidates.sensor_ranges.size(); i_beam += num_parts * beam_step)
+    {
+        for(unsigned int i_yaw = 0; i_yaw < yaws.size(); ++i_yaw)
+        {
+            geo::Transform2 pose;
+            double error;
+            if (!candidates.place(i_beam, i_yaw, pose)
+                    || !scoreDistanceField(candidates, field, candidates.rotated.samples[i_yaw], pose.t, error))
+                continue;
+
+            result.update(error, i_beam * yaws.size() + i_yaw, pose);
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Searches the candidates over a number of threads. Each thread uses its own copy of the candidates (and therefore its
+// own scratch buffers) and keeps its own best candidate; these are combined afterwards.
+struct SearchJob
+{
+    enum Method { EXHAUSTIVE, BRANCH_AND_BOUND, DISTANCE_FIELD };
+
+    SearchJob(Method method_, const PoseCandidates& candidates_, int beam_step_, const std::vector<double>& yaws_,
+              unsigned int num_threads_)
+        : method(method_), candidates(candidates_), beam_step(beam_step_), yaws(yaws_), field(0), beam_bounds(0), num_threads(num_threads_), results(num_threads_) {}
+
+    void operator()(unsigned int i_thread)
+    {
+        PoseCandidates thread_candidates(candidates);
+        SearchResult& result = results[i_thread];
+
+        if (method == EXHAUSTIVE)
+            searchExhaustive(thread_candidates, beam_step, yaws, i_thread, num_threads, result);
+        else if (method == BRANCH_AND_BOUND)
+            searchBranchAndBound(thread_candidates, *beam_bounds, yaws, i_thread, num_threads, result);
+        else
+            searchDistanceField(thread_candidates, *field, beam_step, yaws, i_thread, num_threads, result);
+    }
+
+    // Combines the results of the threads (the same regardless of the number of threads)
+    SearchResult result() const
+    {
+        SearchResult best;
+        for(unsigned int i = 0; i < results.size(); ++i)
+            best.update(results[i].error, results[i].index, results[i].pose);
+        return best;
+    }
+
+    Method method;
+    const PoseCandidates& candidates;
+    int beam_step;
+    const std::vector<double>& yaws;
+
+    // Only used with distance field scoring
+    const DistanceField2D* field;
+
+    // Only used with branch-and-bound
+    const std::vector<std::pair<double, int> >* beam_bounds;
+
+    unsigned int num_threads;
+    std::vector<SearchResult> results;
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+// Solves the symmetric 3x3 system H x = b. Returns false if H is (nearly) singular.
+bool solve3x3(const double H[3][3], const double b[3], double x[3])
+{
+    double c00 = H[1][1] * H[2][2] - H[1][2] * H[2][1];
+    double c01 = H[1][2] * H[2][0] - H[1][0] * H[2][2];
+    double c02 = H[1][0] * H[2][1] - H[1][1] * H[2][0];
+
+    double det = H[0][0] * c00 + H[0][1] * c01 + H[0][2] * c02;
+    if (std::abs(det) < 1e-12)
+        return false;
+
+    double inv[3][3];
+    inv[0][0] = c00;
+    inv[1][0] = c01;
+    inv[2][0] = c02;
+    inv[0][1] = H[0][2] * H[2][1] - H[0][1] * H[2][2];
+    inv[1][1] = H[0][0] * H[2][2] - H[0][2] * H[2][0];
+    inv[2][1] = H[0][1] * H[2][0] - H[0][0] * H[2][1];
+    inv[0][2] = H[0][1] * H[1][2] - H[0][2] * H[1][1];
+    inv[1][2] = H[0][2] * H[1][0] - H[0][0] * H[1][2];
+    inv[2][2] = H[0][0] * H[1][1] - H[0][1] * H[1][0];
+
+    for(int i = 0; i < 3; ++i)
+        x[i] = (inv[i][0] * b[0] + inv[i][1] * b[1] + inv[i][2] * b[2]) / det;
+
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Refines the pose of the shape with Gauss-Newton, minimizing the distances of the measured points to the lines of
+// the closest visible contour edges (point-to-line). Measured points further than 'max_distance' from the shape are
+// not used. The pose is rotated around its own origin.
+void refinePose(const BeamModel& beam_model, const Shape2D& shape, const std::vector<double>& sensor_ranges,
+                unsigned int max_iterations, double max_distance, geo::Transform2& pose, FitterRefinement& result)
+{
+    std::vector<geo::Vec2> points;
+    beam_model.CalculatePoints(sensor_ranges, points);
+
+    // Visible edges at the current pose, as start point and direction
+    std::vector<std::pair<geo::Vec2, geo::Vec2> > edges;
+
+    for(result.iterations = 0; result.iterations < max_iterations; )
+    {
+        edges.clear();
+        for(unsigned int i = 0; i < shape.size(); ++i)
+        {
+            const std::vector<geo::Vec2>& contour = shape[i];
+            for(unsigned int j = 0; j < contour.size(); ++j)
+            {
+                geo::Vec2 p1 = pose * contour[j];
+                geo::Vec2 s = pose * contour[(j + 1) % contour.size()] - p1;
+
+                // Back face culling, as in the beam model
+                if (p1.x * s.y - p1.y * s.x < 0)
+                    edges.push_back(std::make_pair(p1, s));
+            }
+        }
+
+        double H[3][3] = { { 0, 0, 0 }, { 0, 0, 0 }, { 0, 0, 0 } };
+        double g[3] = { 0, 0, 0 };
+        int n = 0;
+
+        for(unsigned int i = 0; i < points.size(); ++i)
+        {
+            const geo::Vec2& q = points[i];
+            if (q.x != q.x)
+                continue;  // No measurement
+
+            // Closest point on the visible edges
+            double min_dist_sq = max_distance * max_distance;
+            int i_edge = -1;
+            geo::Vec2 f_closest;
+            for(unsigned int k = 0; k < edges.size(); ++k)
+            {
+                const geo::Vec2& p1 = edges[k].first;
+                const geo::Vec2& s = edges[k].second;
+
+                double s_sq = s.x * s.x + s.y * s.y;
+                if (s_sq == 0)
+                    continue;
+
+                double u = std::max(0.0, std::min(1.0, ((q.x - p1.x) * s.x + (q.y - p1.y) * s.y) / s_sq));
+                geo::Vec2 f = p1 + s * u;
+
+                double dist_sq = (q.x - f.x) * (q.x - f.x) + (q.y - f.y) * (q.y - f.y);
+                if (dist_sq < min_dist_sq)
+                {
+                    min_dist_sq = dist_sq;
+                    i_edge = k;
+                    f_closest = f;
+                }
+            }
+
+            if (i_edge < 0)
+                continue;
+
+            // Residual along the edge normal, and its derivatives to the translation and the rotation around the
+            // origin of the pose
+            const geo::Vec2& s = edges[i_edge].second;
+            double l = s.length();
+            geo::Vec2 normal(s.y / l, -s.x / l);
+
+            double r = normal.x * (q.x - f_closest.x) + normal.y * (q.y - f_closest.y);
+
+            geo::Vec2 arm = f_closest - pose.t;
+            double J[3] = { -normal.x, -normal.y, normal.x * arm.y - normal.y * arm.x };
+
+            for(int a = 0; a < 3; ++a)
+            {
+                g[a] += J[a] * r;
+                for(int b = 0; b < 3; ++b)
+                    H[a][b] += J[a] * J[b];
+            }
+
+            ++n;
+        }
+
+        if (n < 3)
+            return;
+
+        // Slightly damped (as in Levenberg-Marquardt), such that directions that are not constrained by the points (e.g.,
+        // along the edge if only a single edge is visible) stay put, instead of making the system singular
+        for(int a = 0; a < 3; ++a)
+            H[a][a] += 1e-3 * H[a][a] + 1e-9;
+
+        double b[3] = { -g[0], -g[1], -g[2] };
+        double delta[3];
+        if (!solve3x3(H, b, delta))
+            return;
+
+        ++result.iterations;
+
+        double cos_d = cos(delta[2]);
+        double sin_d = sin(delta[2]);
+        pose.R = geo::Mat2(cos_d, -sin_d, sin_d, cos_d) * pose.R;
+        pose.t += geo::Vec2(delta[0], delta[1]);
+
+        if (std::abs(delta[0]) < 1e-4 && std::abs(delta[1]) < 1e-4 && std::abs(delta[2]) < 1e-4)
+        {
+            result.converged = true;
+            return;
+        }
+    }
+}
+
+} // end anonymous namespace
+
+// ----------------------------------------------------------------------------------------------------
+
+Fitter::Fitter() : exhaustive_search_(false), scoring_method_(BEAM_SCORING), distance_field_resolution_(0.02),
+    distance_field_margin_(0.5), beam_step_(1), yaw_step_(0.1), refinement_iterations_(0), num_threads_(1)
 {
     beam_model_.initialize(4, 200);  // TODO: remove hard-coded values
 }
@@ -68,7 +756,8 @@ Fitter::~Fitter()
 // ----------------------------------------------------------------------------------------------------
 
 bool Fitter::estimateEntityPose(const FitterData& data, const ed::WorldModel& world, const ed::UUID& id,
-                                const geo::Pose3D& expected_pose, geo::Pose3D& fitted_pose, double max_yaw_change, bool state_update)
+                                const geo::Pose3D& expected_pose, geo::Pose3D& fitted_pose, double max_yaw_change, bool state_update,
+                                FitterRefinement* refinement)
 {
     const std::vector<double>& sensor_ranges = data.sensor_ranges;
 
@@ -79,7 +768,7 @@ bool Fitter::estimateEntityPose(const FitterData& data, const ed::WorldModel& wo
     if (!e->shape())
         return false;
 
-    EntityRepresentation2D repr_2d = GetOrCreateEntity2D(e);
+    const EntityRepresentation2D& repr_2d = GetOrCreateEntity2D(e);
     if (repr_2d.shape_2d.empty())
         return false;
 
@@ -97,6 +786,16 @@ bool Fitter::estimateEntityPose(const FitterData& data, const ed::WorldModel& wo
     std::vector<double> model_ranges(sensor_ranges.size(), 0);
     std::vector<int> dummy_identifiers(sensor_ranges.size(), -1);
     std::string thisGroupName = e->stateUpdateGroup(); //Group name of the object thats state is updated
+
+    // The culler holds the view of this fit
+    boost::mutex::scoped_lock culler_lock(culler_mutex_);
+
+    const geo::Vec2& ray_first = beam_model_.rays().front();
+    const geo::Vec2& ray_last = beam_model_.rays().back();
+    double angle_first = atan2(ray_first.y, ray_first.x);
+    double angle_last = atan2(ray_last.y, ray_last.x);
+    culler_.setPlanarView(data.sensor_pose_xya, std::min(angle_first, angle_last), std::max(angle_first, angle_last), 0, false);
+
     for(ed::WorldModel::const_iterator it = world.begin(); it != world.end(); ++it)
     {
         const ed::EntityConstPtr& e = *it;
@@ -121,9 +820,14 @@ bool Fitter::estimateEntityPose(const FitterData& data, const ed::WorldModel& wo
                 continue;
         }
 
+        if (!culler_.isVisible(e)) // Skip entities outside the field of view
+            continue;
+
         renderEntity(e, data.sensor_pose_xya, -1, model_ranges, dummy_identifiers);
     }
 
+    culler_lock.unlock();
+
     geo::Pose3D expected_pose_SENSOR = data.sensor_pose_xya.inverse() * expected_pose;
     double expected_yaw_SENSOR;
     {
@@ -172,96 +876,86 @@ bool Fitter::estimateEntityPose(const FitterData& data, const ed::WorldModel& wo
     // -------------------------------------
     // Fit
 
-    double min_error = 1e9;
-    geo::Transform2 best_pose_SENSOR;
+    std::vector<double> yaws;
+    for(double yaw = min_yaw; yaw < max_yaw; yaw += yaw_step_)
+        yaws.push_back(yaw);
 
-    for(int i_beam = 0; i_beam < sensor_ranges.size(); ++i_beam)
-    {
-        double l = beam_model_.rays()[i_beam].length();
-        geo::Vec2 r = beam_model_.rays()[i_beam] / l;
-
-        for(double yaw = min_yaw; yaw < max_yaw; yaw += 0.1)
-        {
-            // ----------------
-            // Calculate rotation
+    bool use_distance_field = (scoring_method_ == DISTANCE_FIELD_SCORING && !data.distance_field.empty());
 
-            double cos_alpha = cos(yaw);
-            double sin_alpha = sin(yaw);
-            geo::Mat2 rot(cos_alpha, -sin_alpha, sin_alpha, cos_alpha);
-            geo::Transform2 pose(rot, r * 10);
+    std::vector<ContourSample> samples;
+    if (use_distance_field)
+        sampleContours(shape2d_transformed, distance_field_resolution_, samples);
 
-            // ----------------
-            // Determine initial pose based on measured range
+    // The same yaws are used on every beam, so the shape is rotated only once per yaw
+    RotatedShapes rotated(shape2d_transformed, samples, yaws);
 
-            std::vector<double> test_ranges(sensor_ranges.size(), 0);
-            beam_model_.RenderModel(shape2d_transformed, pose, 0, test_ranges, dummy_identifiers);
+    PoseCandidates candidates(beam_model_, shape2d_transformed, rotated, sensor_ranges, model_ranges, expected_center_beam);
 
-            double ds = sensor_ranges[i_beam];
-            double dm = test_ranges[i_beam];
+    std::vector<std::pair<double, int> > beam_bounds;
 
-            if (ds <= 0 || dm <= 0)
-                continue;
-
-            pose.t += r * ((ds - dm) * l);
+    SearchJob::Method method = SearchJob::BRANCH_AND_BOUND;
+    if (use_distance_field)
+        method = SearchJob::DISTANCE_FIELD;
+    else if (exhaustive_search_)
+        method = SearchJob::EXHAUSTIVE;
 
-            // ----------------
-            // Render model
+    SearchJob job(method, candidates, beam_step_, yaws, num_threads_);
 
-            test_ranges = model_ranges;
-            std::vector<int> identifiers(sensor_ranges.size(), 0);
-            beam_model_.RenderModel(shape2d_transformed, pose, 1, test_ranges, identifiers);
+    if (method == SearchJob::DISTANCE_FIELD)
+        job.field = &data.distance_field;
+    else if (method == SearchJob::BRANCH_AND_BOUND)
+    {
+        boundBeams(candidates, beam_step_, beam_bounds);
+        job.beam_bounds = &beam_bounds;
+    }
 
-            if (identifiers[expected_center_beam] != 1)  // expected center beam MUST contain the rendered model
-                continue;
+    runParallel(num_threads_, job);
 
-            // ----------------
-            // Calculate error
+    SearchResult result = job.result();
+    geo::Transform2 best_pose_SENSOR = result.pose;
+    double min_error = result.error;
 
-            int n = 0;
-            double total_error = 0;
-            for(unsigned int i = 0; i < test_ranges.size(); ++i)
-            {
-                double ds = sensor_ranges[i];
-                double dm = test_ranges[i];
+    if (min_error > 1e5)
+    {
+//        std::cout << "No pose found!" << std::endl;
+        return false;
+    }
 
-                if (ds <= 0)
-                    continue;
+    // -------------------------------------
+    // Refine
 
-                ++n;
+    FitterRefinement refinement_result;
 
-                if (dm <= 0)
-                {
-                    total_error += 0.1;
-                    continue;
-                }
+    if (refinement_iterations_ > 0)
+    {
+        geo::Transform2 refined_pose = best_pose_SENSOR;
+        refinePose(beam_model_, shape2d_transformed, sensor_ranges, refinement_iterations_, 0.2, refined_pose, refinement_result);
 
-                double diff = std::abs(ds - dm);
-                if (diff < 0.1)
-                    total_error += diff;
-                else
-                {
-                    if (ds > dm)
-                        total_error += 1;
-                    else
-                        total_error += 0.1;
-                }
+        double error;
+        bool valid;
+        if (use_distance_field)
+        {
+            std::vector<ContourSample> rotated_samples = samples;
+            for(unsigned int i = 0; i < rotated_samples.size(); ++i)
+            {
+                rotated_samples[i].p = refined_pose.R * rotated_samples[i].p;
+                rotated_samples[i].dir = refined_pose.R * rotated_samples[i].dir;
             }
 
-            double error = total_error / n;
+            valid = scoreDistanceField(candidates, data.distance_field, rotated_samples, refined_pose.t, error);
+        }
+        else
+            valid = candidates.score(refined_pose, error);
 
-            if (error < min_error)
-            {
-                best_pose_SENSOR = pose;
-                min_error = error;
-            }
+        if (valid && error <= min_error)
+        {
+            best_pose_SENSOR = refined_pose;
+            refinement_result.accepted = true;
         }
     }
 
-    if (min_error > 1e5)
-    {
-//        std::cout << "No pose found!" << std::endl;
-        return false;
-    }
+    if (refinement)
+        *refinement = refinement_result;
 
     // Correct for shape transformation
     best_pose_SENSOR.t += best_pose_SENSOR.R * -shape_center;
@@ -287,38 +981,59 @@ bool Fitter::estimateEntityPose(const FitterData& data, const ed::WorldModel& wo
 
 void Fitter::processSensorData(const rgbd::Image& image, const geo::Pose3D& sensor_pose, FitterData& data)
 {
-    return processSensorDataImpl(image, sensor_pose, data, false, false, 0, 0);
+    const cv::Mat& depth = image.getDepthImage();
+    rgbd::View view(image, depth.cols);
+
+    ray_table_.update(view.getRasterizer(), depth.cols, depth.rows);
+    cloud_.setFrame(depth, ray_table_, sensor_pose);
+
+    return processSensorDataImpl(cloud_, data, false, false, 0, 0);
 }
 
 void Fitter::processSensorData(const rgbd::Image& image, const geo::Pose3D& sensor_pose, FitterData& data, bool include, float min, float max)
 {
-    return processSensorDataImpl(image, sensor_pose, data, true, include, min, max);
+    const cv::Mat& depth = image.getDepthImage();
+    rgbd::View view(image, depth.cols);
+
+    ray_table_.update(view.getRasterizer(), depth.cols, depth.rows);
+    cloud_.setFrame(depth, ray_table_, sensor_pose);
+
+    return processSensorDataImpl(cloud_, data, true, include, min, max);
 }
 
+void Fitter::processSensorData(OrganizedPointCloud& cloud, FitterData& data)
+{
+    return processSensorDataImpl(cloud, data, false, false, 0, 0);
+}
 
-void Fitter::processSensorDataImpl(const rgbd::Image& image, const geo::Pose3D& sensor_pose, FitterData& data, bool apply_roi, bool include, float min, float max) const
+void Fitter::processSensorData(OrganizedPointCloud& cloud, FitterData& data, bool include, float min, float max)
 {
-    data.sensor_pose = sensor_pose;
-    decomposePose(sensor_pose, data.sensor_pose_xya, data.sensor_pose_zrp);
+    return processSensorDataImpl(cloud, data, true, include, min, max);
+}
 
-    const cv::Mat& depth = image.getDepthImage();
-    rgbd::View view(image, depth.cols);
+
+void Fitter::processSensorDataImpl(OrganizedPointCloud& cloud, FitterData& data, bool apply_roi, bool include, float min, float max) const
+{
+    data.sensor_pose = cloud.sensorPose();
+    decomposePose(data.sensor_pose, data.sensor_pose_xya, data.sensor_pose_zrp);
+
+    const cv::Mat& depth = cloud.depth();
+    cloud.prepare(cv::Rect(0, 0, depth.cols, depth.rows));
 
     std::vector<double>& ranges = data.sensor_ranges;
 
-    if (ranges.size() != beam_model_.num_beams())
-        ranges.resize(beam_model_.num_beams(), 0);
+    // The data may be reused between frames (keeping the memory), so clear the ranges of the previous frame
+    ranges.assign(beam_model_.num_beams(), 0);
 
-    for(int x = 0; x < depth.cols; ++x)
+    for(int y = 0; y < depth.rows; ++y)
     {
-        for(int y = 0; y < depth.rows; ++y)
+        for(int x = 0; x < depth.cols; ++x)
         {
             float d = depth.at<float>(y, x);
             if (d == 0 || d != d)
                 continue;
 
-            geo::Vector3 p_sensor = view.getRasterizer().project2Dto3D(x, y) * d;
-            geo::Vector3 p_floor = data.sensor_pose_zrp * p_sensor;
+            geo::Vector3 p_floor = data.sensor_pose_zrp * cloud.sensorPoint(y * depth.cols + x);
 
             if (p_floor.z < 0.2) // simple floor filter
                 continue;
@@ -351,12 +1066,40 @@ void Fitter::processSensorDataImpl(const rgbd::Image& image, const geo::Pose3D&
             }
         }
     }
+
+    if (scoring_method_ == DISTANCE_FIELD_SCORING)
+        calculateDistanceField(data);
+    else
+        data.distance_field.clear();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void Fitter::calculateDistanceField(FitterData& data) const
+{
+    std::vector<geo::Vec2> points;
+    beam_model_.CalculatePoints(data.sensor_ranges, points);
+
+    // Beams without a measurement result in NaN points
+    std::vector<geo::Vec2>::iterator it_end = points.begin();
+    for(std::vector<geo::Vec2>::const_iterator it = points.begin(); it != points.end(); ++it)
+    {
+        if (it->x == it->x)
+            *it_end++ = *it;
+    }
+    points.erase(it_end, points.end());
+
+    data.distance_field.calculate(points, distance_field_resolution_, distance_field_margin_);
 }
 
 // ----------------------------------------------------------------------------------------------------
 
-EntityRepresentation2D Fitter::GetOrCreateEntity2D(const ed::EntityConstPtr& e)
+const EntityRepresentation2D& Fitter::GetOrCreateEntity2D(const ed::EntityConstPtr& e)
 {
+    // References to the map elements stay valid when other elements are inserted, so only the lookup and creation
+    // need to be guarded
+    boost::mutex::scoped_lock lock(entity_shapes_mutex_);
+
     std::map<ed::UUID, EntityRepresentation2D>::const_iterator it_model = entity_shapes_.find(e->id());
     if (it_model != entity_shapes_.end())
         return it_model->second;
@@ -382,6 +1125,9 @@ void Fitter::renderEntity(const ed::EntityConstPtr& e, const geo::Pose3D& sensor
     if (model_ranges.size() != beam_model_.num_beams())
         model_ranges.resize(beam_model_.num_beams(), 0);
 
+    if (identifiers.size() != beam_model_.num_beams())
+        identifiers.resize(beam_model_.num_beams(), -1);
+
     if (!e->shape() || !e->has_pose())
         return;
 
@@ -390,7 +1136,7 @@ void Fitter::renderEntity(const ed::EntityConstPtr& e, const geo::Pose3D& sensor
     geo::Pose3D pose_zrp;
     decomposePose(e->pose(), pose_xya, pose_zrp);
 
-    EntityRepresentation2D e2d = GetOrCreateEntity2D(e);
+    const EntityRepresentation2D& e2d = GetOrCreateEntity2D(e);
 
     geo::Transform2 pose_2d_SENSOR = sensor_pose_xya_2d.inverse() * XYYawToTransform2(pose_xya);
 
@@ -0,0 +1,79 @@
+#include "ed/kinect/frame_arena.h"
+
+#include <algorithm>
+
+// ----------------------------------------------------------------------------------------------------
+
+FrameArena::FrameArena()
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+FrameArena::~FrameArena()
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void FrameArena::newFrame()
+{
+    std::fill(image_growths_.begin(), image_growths_.end(), 0);
+    std::fill(array_growths_.begin(), array_growths_.end(), 0);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void FrameArena::reserve(unsigned int num_image_slots, unsigned int num_array_slots)
+{
+    if (images_.size() < num_image_slots)
+    {
+        images_.resize(num_image_slots);
+        image_growths_.resize(num_image_slots, 0);
+    }
+
+    if (arrays_.size() < num_array_slots)
+    {
+        arrays_.resize(num_array_slots);
+        array_growths_.resize(num_array_slots, 0);
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+cv::Mat FrameArena::floatImage(unsigned int slot, int rows, int cols)
+{
+    cv::Mat& buffer = images_[slot];
+    if (buffer.rows < rows || buffer.cols < cols)
+    {
+        // Grow in both dimensions, such that differently shaped images fit in the end
+        buffer = cv::Mat(std::max(rows, buffer.rows), std::max(cols, buffer.cols), CV_32FC1);
+        ++image_growths_[slot];
+    }
+
+    return buffer(cv::Rect(0, 0, cols, rows));
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+std::vector<int>& FrameArena::intArray(unsigned int slot, unsigned int size)
+{
+    std::vector<int>& array = arrays_[slot];
+    if (size > array.capacity())
+        ++array_growths_[slot];
+
+    array.resize(size);
+    return array;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+unsigned int FrameArena::numGrowths() const
+{
+    unsigned int n = 0;
+    for(unsigned int i = 0; i < image_growths_.size(); ++i)
+        n += image_growths_[i];
+    for(unsigned int i = 0; i < array_growths_.size(); ++i)
+        n += array_growths_[i];
+    return n;
+}
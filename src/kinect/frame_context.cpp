@@ -0,0 +1,89 @@
+#include "ed/kinect/frame_context.h"
+
+#include <rgbd/Image.h>
+#include <rgbd/View.h>
+
+#include <algorithm>
+
+// ----------------------------------------------------------------------------------------------------
+
+FrameContext::FrameContext()
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+FrameContext::~FrameContext()
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void FrameContext::setFrame(const rgbd::ImageConstPtr& image, const geo::Pose3D& sensor_pose)
+{
+    image_ = image;
+    depth_ = image->getDepthImage();
+
+    rgbd::View view(*image, depth_.cols);
+    cam_ = view.getRasterizer();
+
+    sensor_pose_ = sensor_pose;
+    sensor_pose_inv_ = sensor_pose.inverse();
+
+    invalidateLevels();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void FrameContext::setSensorPose(const geo::Pose3D& sensor_pose)
+{
+    sensor_pose_ = sensor_pose;
+    sensor_pose_inv_ = sensor_pose.inverse();
+
+    invalidateLevels();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void FrameContext::invalidateLevels()
+{
+    for(std::map<int, DepthLevel>::iterator it = levels_.begin(); it != levels_.end(); ++it)
+        it->second.valid = false;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+DepthLevel& FrameContext::level(int factor)
+{
+    factor = std::max(1, factor);
+
+    DepthLevel& level = levels_[factor];
+    if (level.valid)
+        return level;
+
+    if (factor == 1)
+    {
+        level.depth = depth_;
+        level.cam = cam_;
+    }
+    else
+    {
+        rgbd::View view(*image_, depth_.cols / factor);
+        level.cam = view.getRasterizer();
+
+        // Subsample (instead of averaging) to not mix depths over object borders
+        level.depth.create(view.getHeight(), view.getWidth(), CV_32FC1);
+        for(int y = 0; y < level.depth.rows; ++y)
+        {
+            float* row = level.depth.ptr<float>(y);
+            for(int x = 0; x < level.depth.cols; ++x)
+                row[x] = view.getDepth(x, y);
+        }
+    }
+
+    level.rays.update(level.cam, level.depth.cols, level.depth.rows);
+    level.cloud.setFrame(level.depth, level.rays, sensor_pose_);
+    level.valid = true;
+
+    return level;
+}
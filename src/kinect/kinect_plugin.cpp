@@ -34,7 +34,7 @@
 
 // ----------------------------------------------------------------------------------------------------
 
-KinectPlugin::KinectPlugin()
+KinectPlugin::KinectPlugin() : supporting_plane_thickness_(0)
 {
 }
 
@@ -57,6 +57,73 @@ void KinectPlugin::initialize(ed::InitData& init)
         image_buffer_.initialize(topic);
     }
 
+    int num_threads = 1;
+    if (config.value("num_threads", num_threads, tue::OPTIONAL))
+    {
+        ROS_INFO_STREAM("[ED KINECT PLUGIN] Using " << num_threads << " thread(s) for rendering.");
+        updater_.setNumThreads(std::max(1, num_threads));
+    }
+
+    if (config.readGroup("downsample_factors", tue::OPTIONAL))
+    {
+        config.value("fitting", downsample_factors_.fitting, tue::OPTIONAL);
+        config.value("segmentation", downsample_factors_.segmentation, tue::OPTIONAL);
+        config.value("refit", downsample_factors_.refit, tue::OPTIONAL);
+        config.endGroup();
+
+        ROS_INFO_STREAM("[ED KINECT PLUGIN] Downsample factors: fitting " << downsample_factors_.fitting
+                        << ", segmentation " << downsample_factors_.segmentation << ", refit " << downsample_factors_.refit);
+    }
+
+    if (config.value("supporting_plane_thickness", supporting_plane_thickness_, tue::OPTIONAL))
+        ROS_INFO_STREAM("[ED KINECT PLUGIN] Removing supporting planes with thickness " << supporting_plane_thickness_);
+
+    std::string fitter_scoring;
+    if (config.value("fitter_scoring", fitter_scoring, tue::OPTIONAL))
+    {
+        if (fitter_scoring == "beams")
+            updater_.setFitterScoringMethod(Fitter::BEAM_SCORING);
+        else if (fitter_scoring == "distance_field")
+            updater_.setFitterScoringMethod(Fitter::DISTANCE_FIELD_SCORING);
+        else
+            config.addError("Unknown fitter scoring method '" + fitter_scoring + "', use 'beams' or 'distance_field'");
+
+        ROS_INFO_STREAM("[ED KINECT PLUGIN] Fitter scoring: " << fitter_scoring);
+    }
+
+    double fitter_distance_field_resolution = 0.02;
+    double fitter_distance_field_margin = 0.5;
+    bool resolution_set = config.value("fitter_distance_field_resolution", fitter_distance_field_resolution, tue::OPTIONAL);
+    bool margin_set = config.value("fitter_distance_field_margin", fitter_distance_field_margin, tue::OPTIONAL);
+    if (fitter_distance_field_resolution <= 0 || fitter_distance_field_margin <= 0)
+        config.addError("fitter_distance_field_resolution and fitter_distance_field_margin must be positive");
+    else if (resolution_set || margin_set)
+    {
+        ROS_INFO_STREAM("[ED KINECT PLUGIN] Fitter distance field: " << fitter_distance_field_resolution << " m resolution, "
+                        << fitter_distance_field_margin << " m margin");
+        updater_.setFitterDistanceFieldResolution(fitter_distance_field_resolution, fitter_distance_field_margin);
+    }
+
+    int fitter_beam_step = 1;
+    double fitter_yaw_step = 0.1;
+    bool beam_step_set = config.value("fitter_beam_step", fitter_beam_step, tue::OPTIONAL);
+    bool yaw_step_set = config.value("fitter_yaw_step", fitter_yaw_step, tue::OPTIONAL);
+    if (fitter_yaw_step <= 0)
+        config.addError("fitter_yaw_step must be positive");
+    else if (beam_step_set || yaw_step_set)
+    {
+        ROS_INFO_STREAM("[ED KINECT PLUGIN] Fitter search resolution: every " << fitter_beam_step << " beam(s), "
+                        << fitter_yaw_step << " rad");
+        updater_.setFitterSearchResolution(std::max(1, fitter_beam_step), fitter_yaw_step);
+    }
+
+    int fitter_refinement_iterations = 0;
+    if (config.value("fitter_refinement_iterations", fitter_refinement_iterations, tue::OPTIONAL))
+    {
+        ROS_INFO_STREAM("[ED KINECT PLUGIN] Fitter refinement: at most " << fitter_refinement_iterations << " iteration(s)");
+        updater_.setFitterRefinement(std::max(0, fitter_refinement_iterations));
+    }
+
     // - - - - - - - - - - - - - - - - - -
     // Services
 
@@ -319,6 +386,9 @@ bool KinectPlugin::srvUpdateImpl(ed_sensor_integration::Update::Request& req, ed
     // Therefore, only allow rotation updates up to 45 degrees (both clock-wise and anti-clock-wise)
     kinect_update_req.max_yaw_change = 0.25 * M_PI;
 
+    kinect_update_req.downsample_factors = downsample_factors_;
+    kinect_update_req.supporting_plane_thickness = supporting_plane_thickness_;
+
     UpdateResult kinect_update_res(*update_req_);
     if (!updater_.update(*world_, image, sensor_pose, kinect_update_req, kinect_update_res, apply_roi))
     {
@@ -389,7 +459,7 @@ bool KinectPlugin::srvRayTrace(ed_sensor_integration::RayTrace::Request& req, ed
   geo::Pose3D ray_trace_pose;
   geo::convert(req.raytrace_pose.pose, ray_trace_pose);
 
-  ed_ray_tracer::RayTraceResult ray_trace_result = ed_ray_tracer::ray_trace(*world_, ray_trace_pose);
+  ed_ray_tracer::RayTraceResult ray_trace_result = ed_ray_tracer::ray_trace(*world_, ray_trace_pose, ray_trace_culler_);
 
   if (!ray_trace_result.succes_)
   {
@@ -48,6 +48,10 @@ private:
 
     Updater updater_;
 
+    DownsampleFactors downsample_factors_;
+
+    double supporting_plane_thickness_;
+
     RecognizeState recognizeState_;
 
 
@@ -89,6 +93,8 @@ private:
 
     ros::Publisher ray_trace_visualization_publisher_;
 
+    ed_sensor_integration::EntityCuller ray_trace_culler_;
+
 
 
 
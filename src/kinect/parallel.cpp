@@ -0,0 +1,97 @@
+#include "ed/kinect/parallel.h"
+
+#include <boost/bind.hpp>
+
+// ----------------------------------------------------------------------------------------------------
+
+ThreadPool::ThreadPool() : num_pool_threads_(0), generation_(0), busy_(false), stop_(false), function_(0), job_(0),
+    num_threads_(0), num_pending_(0)
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+ThreadPool::~ThreadPool()
+{
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        stop_ = true;
+    }
+
+    start_condition_.notify_all();
+    threads_.join_all();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+ThreadPool& ThreadPool::instance()
+{
+    static ThreadPool pool;
+    return pool;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool ThreadPool::run(unsigned int num_threads, Function function, void* job)
+{
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        if (busy_)
+            return false;
+
+        busy_ = true;
+
+        // Thread 0 is the calling thread
+        for(; num_pool_threads_ + 1 < num_threads; ++num_pool_threads_)
+            threads_.create_thread(boost::bind(&ThreadPool::work, this, num_pool_threads_ + 1, generation_));
+
+        function_ = function;
+        job_ = job;
+        num_threads_ = num_threads;
+        num_pending_ = num_threads - 1;
+        ++generation_;
+    }
+
+    start_condition_.notify_all();
+
+    function(job, 0);
+
+    boost::mutex::scoped_lock lock(mutex_);
+    while (num_pending_ > 0)
+        done_condition_.wait(lock);
+
+    busy_ = false;
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void ThreadPool::work(unsigned int i_thread, unsigned int generation)
+{
+    boost::mutex::scoped_lock lock(mutex_);
+
+    while (true)
+    {
+        while (!stop_ && generation_ == generation)
+            start_condition_.wait(lock);
+
+        if (stop_)
+            return;
+
+        generation = generation_;
+
+        // Jobs with fewer threads than the pool leave the remaining pool threads idle
+        if (i_thread >= num_threads_)
+            continue;
+
+        Function function = function_;
+        void* job = job_;
+
+        lock.unlock();
+        function(job, i_thread);
+        lock.lock();
+
+        if (--num_pending_ == 0)
+            done_condition_.notify_one();
+    }
+}
@@ -0,0 +1,154 @@
+#include "ed/kinect/point_cloud.h"
+
+#include <geolib/sensors/DepthCamera.h>
+
+#include <algorithm>
+
+// ----------------------------------------------------------------------------------------------------
+
+RayTable::RayTable() : fx_(0), fy_(0), cx_(0), cy_(0)
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+RayTable::~RayTable()
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void RayTable::update(const geo::DepthCamera& cam, int width, int height)
+{
+    if (width == (int)xs_.size() && height == (int)ys_.size()
+            && cam.getFocalLengthX() == fx_ && cam.getFocalLengthY() == fy_
+            && cam.getOpticalCenterX() == cx_ && cam.getOpticalCenterY() == cy_)
+        return;
+
+    fx_ = cam.getFocalLengthX();
+    fy_ = cam.getFocalLengthY();
+    cx_ = cam.getOpticalCenterX();
+    cy_ = cam.getOpticalCenterY();
+
+    xs_.resize(width);
+    for(int x = 0; x < width; ++x)
+        xs_[x] = cam.project2Dto3DX(x);
+
+    ys_.resize(height);
+    for(int y = 0; y < height; ++y)
+        ys_[y] = cam.project2Dto3DY(y);
+}
+
+// ----------------------------------------------------------------------------------------------------
+// ----------------------------------------------------------------------------------------------------
+
+OrganizedPointCloud::OrganizedPointCloud() : depth_(0), rays_(0)
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+OrganizedPointCloud::~OrganizedPointCloud()
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void OrganizedPointCloud::setFrame(const cv::Mat& depth, const RayTable& rays, const geo::Pose3D& sensor_pose)
+{
+    depth_ = &depth;
+    rays_ = &rays;
+    sensor_pose_ = sensor_pose;
+
+    // Buffers are kept between frames, only their contents is invalidated
+    unsigned int size = depth.rows * depth.cols;
+    if (sensor_x_.size() != size)
+    {
+        sensor_x_.resize(size);
+        sensor_y_.resize(size);
+        map_x_.resize(size);
+        map_y_.resize(size);
+        map_z_.resize(size);
+    }
+
+    row_begin_.assign(depth.rows, 0);
+    row_end_.assign(depth.rows, 0);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void OrganizedPointCloud::prepare(const cv::Rect& roi)
+{
+    cv::Rect r = roi & cv::Rect(0, 0, depth_->cols, depth_->rows);
+
+    int x_begin = r.x;
+    int x_end = r.x + r.width;
+
+    for(int y = r.y; y < r.y + r.height; ++y)
+    {
+        int& begin = row_begin_[y];
+        int& end = row_end_[y];
+
+        if (begin == end)
+        {
+            calculate(y, x_begin, x_end);
+            begin = x_begin;
+            end = x_end;
+            continue;
+        }
+
+        // Extend the calculated range of the row such that it covers the area (and everything in between)
+        if (x_begin < begin)
+        {
+            calculate(y, x_begin, begin);
+            begin = x_begin;
+        }
+
+        if (x_end > end)
+        {
+            calculate(y, end, x_end);
+            end = x_end;
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void OrganizedPointCloud::calculate(int y, int x_begin, int x_end)
+{
+    const RayTable& rays = *rays_;
+    const float* d = depth_->ptr<float>(y);
+
+    int offset = y * depth_->cols;
+    float* sx = &sensor_x_[offset];
+    float* sy = &sensor_y_[offset];
+    float* mx = &map_x_[offset];
+    float* my = &map_y_[offset];
+    float* mz = &map_z_[offset];
+
+    float ry = rays.y(y);
+
+    const geo::Mat3& R = sensor_pose_.R;
+    const geo::Vec3& t = sensor_pose_.t;
+
+    float r00 = R.xx, r01 = R.xy, r02 = R.xz;
+    float r10 = R.yx, r11 = R.yy, r12 = R.yz;
+    float r20 = R.zx, r21 = R.zy, r22 = R.zz;
+    float tx = t.x, ty = t.y, tz = t.z;
+
+    // Plain loop without branches over the row, such that the compiler can vectorize it. Invalid depths
+    // simply result in invalid points.
+    for(int x = x_begin; x < x_end; ++x)
+    {
+        float px = rays.x(x) * d[x];
+        float py = ry * d[x];
+        float pz = -d[x];
+
+        sx[x] = px;
+        sy[x] = py;
+
+        mx[x] = r00 * px + r01 * py + r02 * pz + tx;
+        my[x] = r10 * px + r11 * py + r12 * pz + ty;
+        mz[x] = r20 * px + r21 * py + r22 * pz + tz;
+    }
+}
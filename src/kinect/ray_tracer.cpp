@@ -39,14 +39,21 @@ public:
 
 };
 
-RayTraceResult ray_trace(const ed::WorldModel& world, const geo::Pose3D& raytrace_pose)
+RayTraceResult ray_trace(const ed::WorldModel& world, const geo::Pose3D& raytrace_pose,
+                         ed_sensor_integration::EntityCuller& culler)
 {
   PointRenderResult res;
 
+  double angle_limit = 1e-3;
+  double max_range = 10;
+
   geo::LaserRangeFinder lrf;
-  lrf.setAngleLimits(-1e-3, 1e-3);
+  lrf.setAngleLimits(-angle_limit, angle_limit);
   lrf.setNumBeams(1);
-  lrf.setRangeLimits(0, 10);
+  lrf.setRangeLimits(0, max_range);
+
+  // Only entities that can intersect the ray are rendered
+  culler.setPlanarView(raytrace_pose, -angle_limit, angle_limit, max_range, true);
 
   // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
   // Raytrace for each entity in the wm
@@ -55,7 +62,7 @@ RayTraceResult ray_trace(const ed::WorldModel& world, const geo::Pose3D& raytrac
   {
     const ed::EntityConstPtr& e = *it;
 
-    if (!e->shape() || !e->has_pose())
+    if (!culler.isVisible(e))
       continue;
 
     geo::LaserRangeFinder::RenderOptions opt;
@@ -7,6 +7,8 @@
 #include <opencv2/core/core.hpp>
 #include <set>
 
+#include "ed_sensor_integration/entity_culler.h"
+
 namespace ed_ray_tracer
 {
 
@@ -22,7 +24,8 @@ struct RayTraceResult {
   geo::Vector3 intersection_point_;
 };
 
-RayTraceResult ray_trace(const ed::WorldModel& world, const geo::Pose3D& raytrace_pose);
+RayTraceResult ray_trace(const ed::WorldModel& world, const geo::Pose3D& raytrace_pose,
+                         ed_sensor_integration::EntityCuller& culler);
 
 }
 
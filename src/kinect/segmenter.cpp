@@ -9,8 +9,11 @@
 #include <ed/world_model.h>
 #include <ed/entity.h>
 
+#include "ed/kinect/parallel.h"
+
+#include <cmath>
+
 // Clustering
-#include <queue>
 #include <ed/convex_hull_calc.h>
 
 // Visualization
@@ -18,7 +21,7 @@
 
 // ----------------------------------------------------------------------------------------------------
 
-Segmenter::Segmenter()
+Segmenter::Segmenter() : num_threads_(1)
 {
 }
 
@@ -30,228 +33,798 @@ Segmenter::~Segmenter()
 
 // ----------------------------------------------------------------------------------------------------
 
+void Segmenter::setNumThreads(unsigned int num_threads)
+{
+    num_threads_ = std::max(1u, num_threads);
+    background_renderer_.setNumThreads(num_threads_);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void Segmenter::removeBackground(cv::Mat& depth_image, const WorldOverlay& world, const geo::DepthCamera& cam,
+                                 const geo::Pose3D& sensor_pose, double background_padding)
+{
+    removeBackground(depth_image, world, cam, sensor_pose, background_padding, cv::Rect(0, 0, depth_image.cols, depth_image.rows));
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void Segmenter::removeBackground(cv::Mat& depth_image, const WorldOverlay& world, const geo::DepthCamera& cam,
+                                 const geo::Pose3D& sensor_pose, double background_padding, const cv::Rect& roi)
+{
+    cv::Rect r = roi & cv::Rect(0, 0, depth_image.cols, depth_image.rows);
+    if (r.area() == 0)
+        return;  // Nothing to filter; rendering would only throw away the cached render
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // Render the world model as seen by the depth sensor
+
+    const cv::Mat& depth_model = background_renderer_.render(world, cam, sensor_pose, depth_image.cols, depth_image.rows);
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // Filter all points that can be associated with the rendered depth image
+
+    for(int y = r.y; y < r.y + r.height; ++y)
+    {
+        float* ds_row = depth_image.ptr<float>(y);
+        const float* dm_row = depth_model.ptr<float>(y);
+        for(int x = r.x; x < r.x + r.width; ++x)
+        {
+            float& ds = ds_row[x];
+            float dm = dm_row[x];
+            if (dm > 0 && ds > 0 && ds > dm - background_padding)
+                ds = 0;
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
 namespace
 {
 
-class DepthRenderer : public geo::RenderResult
+class MinMaxRenderer : public geo::RenderResult
 {
 
 public:
 
-    DepthRenderer(cv::Mat& z_buffer_)
-        : geo::RenderResult(z_buffer_.cols, z_buffer_.rows), z_buffer(z_buffer_)
+    // Only renders the given image area. The buffers have the size of the area.
+    MinMaxRenderer(int width, int height, const cv::Rect& rect_, cv::Mat& min_buffer_, cv::Mat& max_buffer_)
+        : geo::RenderResult(width, height), rect(rect_), min_buffer(min_buffer_), max_buffer(max_buffer_)
     {
     }
 
     void renderPixel(int x, int y, float depth, int i_triangle)
     {
-        float& old_depth = z_buffer.at<float>(y, x);
-        if (old_depth == 0 || depth < old_depth)
+        if (y < rect.y || y >= rect.y + rect.height || x < rect.x || x >= rect.x + rect.width)
+            return;
+
+        // TODO: now the renderer can only deal with convex meshes, which means
+        // that at each pixel there can only be one minimum and one maximum pixel
+        // There is an easy solution for concave meshes: determine which side
+        // the triangle points (away or to the camera) and test the pixel in the depth
+        // image to be on the correct side. ... etc ...
+
+        float& d_min = min_buffer.at<float>(y - rect.y, x - rect.x);
+        float& d_max = max_buffer.at<float>(y - rect.y, x - rect.x);
+
+        if (d_min == 0 || depth < d_min)
+            d_min = depth;
+
+        d_max = std::max(d_max, depth);
+    }
+
+    const cv::Rect& rect;
+    cv::Mat& min_buffer;
+    cv::Mat& max_buffer;
+
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+// Points that can be associated with the rendered world model (background)
+inline bool isBackground(float d, const cv::Mat* background, double background_padding, int x, int y)
+{
+    if (!background)
+        return false;
+
+    float dm = background->at<float>(y, x);
+    return dm > 0 && d > dm - background_padding;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Filters the depth image within the given image area on the rendered minimum and maximum depth of the shape,
+// each thread handles a stripe of rows. If a background is given, points that belong to it are filtered out as
+// well. The min and max buffers have the size of the area, the filtered image starts at 'origin' in the depth
+// image.
+struct PointsWithinJob
+{
+    PointsWithinJob(const cv::Rect& rect_, const cv::Mat& depth_image_, const cv::Mat* background_, double background_padding_,
+                    const cv::Mat& min_buffer_, const cv::Mat& max_buffer_, cv::Mat& filtered_depth_image_,
+                    const cv::Point& origin_, unsigned int num_threads_)
+        : rect(rect_), depth_image(depth_image_), background(background_),
+          background_padding(background_padding_), min_buffer(min_buffer_), max_buffer(max_buffer_),
+          filtered_depth_image(filtered_depth_image_), origin(origin_), num_threads(num_threads_) {}
+
+    void operator()(unsigned int i_thread)
+    {
+        unsigned int y_begin, y_end;
+        partitionRange(rect.height, num_threads, i_thread, y_begin, y_end);
+        y_begin += rect.y;
+        y_end += rect.y;
+
+        for(unsigned int y = y_begin; y < y_end; ++y)
         {
-            old_depth = depth;
+            for(int x = rect.x; x < rect.x + rect.width; ++x)
+            {
+                float d = depth_image.at<float>(y, x);
+                if (d <= 0)
+                    continue;
+
+                float d_min = min_buffer.at<float>(y - rect.y, x - rect.x);
+                float d_max = max_buffer.at<float>(y - rect.y, x - rect.x);
+
+                if (d_min > 0 && d_max > 0 && d >= d_min && d <= d_max
+                        && !isBackground(d, background, background_padding, x, y))
+                    filtered_depth_image.at<float>(y - origin.y, x - origin.x) = d;
+            }
         }
     }
 
-    cv::Mat& z_buffer;
+    const cv::Rect& rect;
+    const cv::Mat& depth_image;
+    const cv::Mat* background;
+    double background_padding;
+    const cv::Mat& min_buffer;
+    const cv::Mat& max_buffer;
+    cv::Mat& filtered_depth_image;
+    cv::Point origin;
+    unsigned int num_threads;
 };
 
-}
+// ----------------------------------------------------------------------------------------------------
+
+// Convex shape described by the half spaces n * p <= d
+struct ConvexPolytope
+{
+    std::vector<geo::Vec3> normals;
+    std::vector<double> offsets;
+};
 
 // ----------------------------------------------------------------------------------------------------
 
-void Segmenter::removeBackground(cv::Mat& depth_image, const ed::WorldModel& world, const geo::DepthCamera& cam,
-                                 const geo::Pose3D& sensor_pose, double background_padding)
+// Determines the planes of the mesh, transformed with the given pose. Returns false if the mesh is not
+// convex, in which case it can not be described by its planes.
+bool getConvexPolytope(const geo::Mesh& mesh, const geo::Pose3D& pose, ConvexPolytope& polytope)
 {
-    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-    // Render the world model as seen by the depth sensor
+    const std::vector<geo::Vec3>& points = mesh.getPoints();
+    const std::vector<geo::TriangleI>& triangles = mesh.getTriangleIs();
 
-    cv::Mat depth_model(depth_image.rows, depth_image.cols, CV_32FC1, 0.0);
+    if (points.empty() || triangles.empty())
+        return false;
 
-    DepthRenderer res(depth_model);
-    for(ed::WorldModel::const_iterator it = world.begin(); it != world.end(); ++it)
+    geo::Vec3 center(0, 0, 0);
+    for(std::vector<geo::Vec3>::const_iterator it = points.begin(); it != points.end(); ++it)
+        center += *it;
+    center = center / points.size();
+
+    double eps = 1e-6;
+
+    for(std::vector<geo::TriangleI>::const_iterator it = triangles.begin(); it != triangles.end(); ++it)
     {
-        const ed::EntityConstPtr& e = *it;
-        if (!e->shape() || !e->has_pose())
+        const geo::Vec3& p1 = points[it->i1];
+        geo::Vec3 n = (points[it->i2] - p1).cross(points[it->i3] - p1);
+
+        double l = n.length();
+        if (l < eps)
+            continue; // Degenerate triangle
+
+        n = n / l;
+        double d = n.dot(p1);
+
+        // Do not depend on the triangle winding: make sure the center is on the inside
+        if (n.dot(center) > d)
+        {
+            n = -n;
+            d = -d;
+        }
+
+        // Many triangles share the same plane (e.g., two per box side)
+        bool duplicate = false;
+        for(unsigned int i = 0; i < polytope.normals.size(); ++i)
+        {
+            if (polytope.normals[i].dot(n) > 1 - eps && std::abs(polytope.offsets[i] - d) < eps)
+            {
+                duplicate = true;
+                break;
+            }
+        }
+
+        if (duplicate)
             continue;
 
-        geo::RenderOptions opt;
-        opt.setMesh(e->shape()->getMesh(), sensor_pose.inverse() * e->pose());
-        cam.render(opt, res);
+        // All points must lie on the inside of each plane, otherwise the mesh is not convex
+        for(std::vector<geo::Vec3>::const_iterator it_p = points.begin(); it_p != points.end(); ++it_p)
+        {
+            if (n.dot(*it_p) > d + eps)
+                return false;
+        }
+
+        polytope.normals.push_back(n);
+        polytope.offsets.push_back(d);
     }
 
-    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-    // Filter all points that can be associated with the rendered depth image
+    if (polytope.normals.size() < 4)
+        return false; // Flat shape
 
-    unsigned int size = depth_image.rows * depth_image.cols;
-    for(unsigned int i = 0; i < size; ++i)
+    // n * (R^T * (p - t)) <= d  <=>  (R * n) * p <= d + (R * n) * t
+    for(unsigned int i = 0; i < polytope.normals.size(); ++i)
     {
-        float& ds = depth_image.at<float>(i);
-        float dm = depth_model.at<float>(i);
-        if (dm > 0 && ds > 0 && ds > dm - background_padding)
-            ds = 0;
+        polytope.normals[i] = pose.R * polytope.normals[i];
+        polytope.offsets[i] += polytope.normals[i].dot(pose.t);
     }
+
+    return true;
 }
 
 // ----------------------------------------------------------------------------------------------------
 
-class MinMaxRenderer : public geo::RenderResult
+// Determines the image area the transformed mesh projects to. If the mesh is (partially) behind the camera,
+// this is the whole image.
+cv::Rect getProjectedBounds(const geo::Mesh& mesh, const geo::Pose3D& pose, const geo::DepthCamera& cam, int width, int height)
 {
+    cv::Rect full(0, 0, width, height);
 
-public:
+    const std::vector<geo::Vec3>& points = mesh.getPoints();
 
-    MinMaxRenderer(int width, int height) : geo::RenderResult(width, height)
+    int x_min = width;
+    int y_min = height;
+    int x_max = -1;
+    int y_max = -1;
+
+    for(std::vector<geo::Vec3>::const_iterator it = points.begin(); it != points.end(); ++it)
     {
-        min_buffer = cv::Mat(height, width, CV_32FC1, 0.0);
-        max_buffer = cv::Mat(height, width, CV_32FC1, 0.0);
+        geo::Vec3 p = pose * (*it);
+        if (p.z > -1e-3)
+            return full;
+
+        cv::Point2d p_2d = cam.project3Dto2D(p);
+        x_min = std::min<int>(x_min, std::floor(p_2d.x));
+        y_min = std::min<int>(y_min, std::floor(p_2d.y));
+        x_max = std::max<int>(x_max, std::ceil(p_2d.x));
+        y_max = std::max<int>(y_max, std::ceil(p_2d.y));
     }
 
-    void renderPixel(int x, int y, float depth, int i_triangle)
+    if (x_max < x_min)
+        return cv::Rect();
+
+    return cv::Rect(x_min - 1, y_min - 1, x_max - x_min + 3, y_max - y_min + 3) & full;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Filters the depth image within the given image area by testing the back-projected points against the
+// planes of the convex shape. Each thread handles a stripe of rows. If a background is given, points that
+// belong to it are filtered out as well. The filtered image starts at 'origin' in the depth image.
+struct PointsWithinConvexJob
+{
+    PointsWithinConvexJob(const geo::DepthCamera& cam_, const ConvexPolytope& polytope_, const cv::Rect& rect_,
+                          const cv::Mat& depth_image_, const cv::Mat* background_, double background_padding_,
+                          cv::Mat& filtered_depth_image_, const cv::Point& origin_, unsigned int num_threads_)
+        : cam(cam_), polytope(polytope_), rect(rect_), depth_image(depth_image_), background(background_),
+          background_padding(background_padding_), filtered_depth_image(filtered_depth_image_), origin(origin_),
+          num_threads(num_threads_) {}
+
+    void operator()(unsigned int i_thread)
     {
-        // TODO: now the renderer can only deal with convex meshes, which means
-        // that at each pixel there can only be one minimum and one maximum pixel
-        // There is an easy solution for concave meshes: determine which side
-        // the triangle points (away or to the camera) and test the pixel in the depth
-        // image to be on the correct side. ... etc ...
+        unsigned int y_begin, y_end;
+        partitionRange(rect.height, num_threads, i_thread, y_begin, y_end);
 
-        float& d_min = min_buffer.at<float>(y, x);
-        float& d_max = max_buffer.at<float>(y, x);
+        unsigned int num_planes = polytope.normals.size();
 
-        if (d_min == 0 || depth < d_min)
-            d_min = depth;
+        for(int y = rect.y + y_begin; y < rect.y + (int)y_end; ++y)
+        {
+            double ry = cam.project2Dto3DY(y);
 
-        d_max = std::max(d_max, depth);
+            const float* d_row = depth_image.ptr<float>(y);
+            float* filtered_row = filtered_depth_image.ptr<float>(y - origin.y) - origin.x;
+
+            for(int x = rect.x; x < rect.x + rect.width; ++x)
+            {
+                float d = d_row[x];
+                if (!(d > 0) || isBackground(d, background, background_padding, x, y))
+                    continue;
+
+                geo::Vec3 p(cam.project2Dto3DX(x) * d, ry * d, -d);
+
+                unsigned int i = 0;
+                for(; i < num_planes; ++i)
+                {
+                    if (polytope.normals[i].dot(p) > polytope.offsets[i])
+                        break;
+                }
+
+                if (i == num_planes)
+                    filtered_row[x] = d;
+            }
+        }
     }
 
-    cv::Mat min_buffer;
-    cv::Mat max_buffer;
+    const geo::DepthCamera& cam;
+    const ConvexPolytope& polytope;
+    const cv::Rect& rect;
+    const cv::Mat& depth_image;
+    const cv::Mat* background;
+    double background_padding;
+    cv::Mat& filtered_depth_image;
+    cv::Point origin;
+    unsigned int num_threads;
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+// Two neighboring points belong to the same cluster if their depth is similar
+inline bool connected(float d1, float d2)
+{
+    return std::abs<float>(d1 - d2) < 0.05;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+inline int findRoot(std::vector<int>& parents, int i)
+{
+    while (parents[i] != i)
+    {
+        parents[i] = parents[parents[i]];
+        i = parents[i];
+    }
+    return i;
+}
 
+// ----------------------------------------------------------------------------------------------------
+
+// Merges the sets of i1 and i2. The root of a set is always its lowest index, i.e., its first pixel
+inline void unite(std::vector<int>& parents, int i1, int i2)
+{
+    int r1 = findRoot(parents, i1);
+    int r2 = findRoot(parents, i2);
+
+    if (r1 < r2)
+        parents[r2] = r1;
+    else if (r2 < r1)
+        parents[r1] = r2;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Connected component labeling of the depth image within the given image area. Each thread labels its own
+// stripe of rows, only looking at neighbors within the stripe. Invalid pixels get label -1.
+struct LabelJob
+{
+    LabelJob(const cv::Mat& depth_image_, const cv::Rect& rect_, std::vector<int>& parents_, unsigned int num_threads_)
+        : depth_image(depth_image_), rect(rect_), parents(parents_), num_threads(num_threads_) {}
+
+    void operator()(unsigned int i_thread)
+    {
+        unsigned int y_begin, y_end;
+        partitionRange(rect.height, num_threads, i_thread, y_begin, y_end);
+
+        for(int y = y_begin; y < (int)y_end; ++y)
+        {
+            const float* d_row = depth_image.ptr<float>(rect.y + y) + rect.x;
+
+            for(int x = 0; x < rect.width; ++x)
+            {
+                int i = y * rect.width + x;
+
+                float d = d_row[x];
+                if (d == 0 || d != d)
+                {
+                    parents[i] = -1;
+                    continue;
+                }
+
+                parents[i] = i;
+
+                // Also try one pixel skipped (filtering may cause some 1-pixel gaps)
+                for(int k = 1; k <= 2; ++k)
+                {
+                    if (x >= k && parents[i - k] >= 0 && connected(d, d_row[x - k]))
+                        unite(parents, i, i - k);
+
+                    if (y - k >= (int)y_begin && parents[i - k * rect.width] >= 0
+                            && connected(d, depth_image.at<float>(rect.y + y - k, rect.x + x)))
+                        unite(parents, i, i - k * rect.width);
+                }
+            }
+        }
+    }
+
+    const cv::Mat& depth_image;
+    const cv::Rect& rect;
+    std::vector<int>& parents;
+    unsigned int num_threads;
 };
 
+} // end unnamed namespace
+
 // ----------------------------------------------------------------------------------------------------
 
 void Segmenter::calculatePointsWithin(const rgbd::Image& image, const geo::Shape& shape,
                                       const geo::Pose3D& shape_pose, cv::Mat& filtered_depth_image) const
 {
-    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-    // Render shape
+    cv::Rect roi;
+    calculatePointsWithin(image, shape, shape_pose, filtered_depth_image, roi);
+}
 
+// ----------------------------------------------------------------------------------------------------
+
+void Segmenter::calculatePointsWithin(const rgbd::Image& image, const geo::Shape& shape,
+                                      const geo::Pose3D& shape_pose, cv::Mat& filtered_depth_image, cv::Rect& roi) const
+{
     const cv::Mat& depth_image = image.getDepthImage();
 
     rgbd::View view(image, depth_image.cols);
     const geo::DepthCamera& cam_model = view.getRasterizer();
 
-    MinMaxRenderer res(depth_image.cols, depth_image.rows);
+    filterPointsWithin(depth_image, cam_model, shape, shape_pose, 0, 0, false, num_threads_, filtered_depth_image, roi);
+}
 
-    geo::RenderOptions opt;
-    opt.setBackFaceCulling(false);
-    opt.setMesh(shape.getMesh(), shape_pose);
+// ----------------------------------------------------------------------------------------------------
 
-    cam_model.render(opt, res);
+void Segmenter::calculatePointsWithin(const cv::Mat& depth_image, const geo::DepthCamera& cam_model, const geo::Shape& shape,
+                                      const geo::Pose3D& shape_pose, cv::Mat& filtered_depth_image, cv::Rect& roi) const
+{
+    filterPointsWithin(depth_image, cam_model, shape, shape_pose, 0, 0, false, num_threads_, filtered_depth_image, roi);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void Segmenter::calculatePointsWithinWindow(const cv::Mat& depth_image, const geo::DepthCamera& cam_model, const geo::Shape& shape,
+                                            const geo::Pose3D& shape_pose, cv::Mat& filtered_window, cv::Rect& roi,
+                                            unsigned int num_threads) const
+{
+    if (num_threads == 0)
+        num_threads = num_threads_;
+
+    filterPointsWithin(depth_image, cam_model, shape, shape_pose, 0, 0, true, num_threads, filtered_window, roi);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void Segmenter::calculatePointsWithinAndRemoveBackground(const cv::Mat& depth_image, const geo::DepthCamera& cam_model,
+                                                         const geo::Shape& shape, const geo::Pose3D& shape_pose,
+                                                         const WorldOverlay& world, const geo::Pose3D& sensor_pose,
+                                                         double background_padding, cv::Mat& filtered_depth_image, cv::Rect& roi)
+{
+    const cv::Mat& depth_model = background_renderer_.render(world, cam_model, sensor_pose, depth_image.cols, depth_image.rows);
+
+    filterPointsWithin(depth_image, cam_model, shape, shape_pose, &depth_model, background_padding, false, num_threads_,
+                       filtered_depth_image, roi);
+}
+
+// ----------------------------------------------------------------------------------------------------
 
-    filtered_depth_image = cv::Mat(depth_image.rows, depth_image.cols, CV_32FC1, 0.0);
+void Segmenter::filterPointsWithin(const cv::Mat& depth_image, const geo::DepthCamera& cam_model, const geo::Shape& shape,
+                                   const geo::Pose3D& shape_pose, const cv::Mat* background, double background_padding,
+                                   bool window_only, unsigned int max_num_threads, cv::Mat& filtered_depth_image,
+                                   cv::Rect& roi) const
+{
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // Render shape and filter points
 
-    for(int i = 0; i < depth_image.cols * depth_image.rows; ++i)
+    // Points outside the area the shape projects to can never be within the shape
+    roi = getProjectedBounds(shape.getMesh(), shape_pose, cam_model, depth_image.cols, depth_image.rows);
+
+    cv::Point origin(0, 0);
+    int rows = depth_image.rows;
+    int cols = depth_image.cols;
+    if (window_only)
     {
-        float d = depth_image.at<float>(i);
-        if (d <= 0)
-            continue;
+        rows = roi.height;
+        cols = roi.width;
+        origin = roi.tl();
+    }
+
+    // Reuse the memory of the given image if it is large enough (e.g., a buffer that is kept between frames)
+    if (filtered_depth_image.type() == CV_32FC1 && filtered_depth_image.rows >= rows && filtered_depth_image.cols >= cols)
+        filtered_depth_image = filtered_depth_image(cv::Rect(0, 0, cols, rows));
+    else
+        filtered_depth_image = cv::Mat(rows, cols, CV_32FC1);
+
+    filtered_depth_image.setTo(0.0);
 
-        float d_min = res.min_buffer.at<float>(i);
-        float d_max = res.max_buffer.at<float>(i);
+    if (roi.area() == 0)
+        return;
 
-        if (d_min > 0 && d_max > 0 && d >= d_min && d <= d_max)
-            filtered_depth_image.at<float>(i) = d;
+    // Most shapes (boxes, convex hull prisms) are convex. In that case we can directly test the points
+    // against the planes of the shape, only within the area the shape projects to
+    ConvexPolytope polytope;
+    if (getConvexPolytope(shape.getMesh(), shape_pose, polytope))
+    {
+        unsigned int num_threads = std::max(1u, std::min<unsigned int>(max_num_threads, roi.height));
+        PointsWithinConvexJob job(cam_model, polytope, roi, depth_image, background, background_padding,
+                                  filtered_depth_image, origin, num_threads);
+        runParallel(num_threads, job);
+        return;
     }
 
-//    cv::imshow("min", res.min_buffer / 10);
-//    cv::imshow("max", res.max_buffer / 10);
-//    cv::imshow("diff", (res.max_buffer - res.min_buffer) * 10);
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // General case: render the shape and keep the points between the minimum and maximum rendered depth
+
+    cv::Mat min_buffer(roi.height, roi.width, CV_32FC1, 0.0);
+    cv::Mat max_buffer(roi.height, roi.width, CV_32FC1, 0.0);
+
+    geo::RenderOptions opt;
+    opt.setBackFaceCulling(false);
+    opt.setMesh(shape.getMesh(), shape_pose);
+
+    // The shape is rendered once; only the filtering is divided over the threads
+    MinMaxRenderer res(depth_image.cols, depth_image.rows, roi, min_buffer, max_buffer);
+    cam_model.render(opt, res);
+
+    unsigned int num_threads = std::max(1u, std::min<unsigned int>(max_num_threads, roi.height));
+    PointsWithinJob job(roi, depth_image, background, background_padding, min_buffer, max_buffer,
+                        filtered_depth_image, origin, num_threads);
+    runParallel(num_threads, job);
+
+//    cv::imshow("min", min_buffer / 10);
+//    cv::imshow("max", max_buffer / 10);
+//    cv::imshow("diff", (max_buffer - min_buffer) * 10);
 //    cv::imshow("filtered", filtered_depth_image / 10);
 //    cv::waitKey();
 }
 
 // ----------------------------------------------------------------------------------------------------
 
-void Segmenter::cluster(const cv::Mat& depth_image, const geo::DepthCamera& cam_model,
-                        const geo::Pose3D& sensor_pose, std::vector<EntityUpdate>& clusters) const
+bool Segmenter::removeSupportingPlane(cv::Mat& depth_image, OrganizedPointCloud& cloud, const cv::Rect& roi,
+                                      double thickness) const
 {
-    int width = depth_image.cols;
-    int height = depth_image.rows;
+    cv::Rect r = roi & cv::Rect(0, 0, depth_image.cols, depth_image.rows);
+    if (r.area() == 0 || thickness <= 0)
+        return false;
 
-    cv::Mat visited(height, width, CV_8UC1, cv::Scalar(0));
+    cloud.prepare(r);
 
-    // Mark borders as visited (2-pixel border)
-    for(int x = 0; x < width; ++x)
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // Height range of the points
+
+    float z_min = 1e9;
+    float z_max = -1e9;
+    int num_points = 0;
+
+    for(int y = r.y; y < r.y + r.height; ++y)
     {
-        visited.at<unsigned char>(0, x) = 1;
-        visited.at<unsigned char>(1, x) = 1;
-        visited.at<unsigned char>(height - 1, x) = 1;
-        visited.at<unsigned char>(height - 2, x) = 1;
+        const float* d_row = depth_image.ptr<float>(y);
+        for(int x = r.x; x < r.x + r.width; ++x)
+        {
+            if (!(d_row[x] > 0))
+                continue;
+
+            float z = cloud.mapZ(y * depth_image.cols + x);
+            z_min = std::min(z_min, z);
+            z_max = std::max(z_max, z);
+            ++num_points;
+        }
     }
 
-    for(int y = 0; y < height; ++y)
+    // Too few points to speak of a supporting plane (same as the minimum cluster size)
+    if (num_points < 100)
+        return false;
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // Histogram of the heights, with bins as wide as the plane is thick
+
+    float bin_size = std::max<float>(thickness, (z_max - z_min) / 4096);
+    std::vector<int> histogram((z_max - z_min) / bin_size + 1, 0);
+
+    for(int y = r.y; y < r.y + r.height; ++y)
     {
-        visited.at<unsigned char>(y, 0) = 1;
-        visited.at<unsigned char>(y, 1) = 1;
-        visited.at<unsigned char>(y, width - 1) = 1;
-        visited.at<unsigned char>(y, width - 2) = 1;
+        const float* d_row = depth_image.ptr<float>(y);
+        for(int x = r.x; x < r.x + r.width; ++x)
+        {
+            if (d_row[x] > 0)
+                ++histogram[(cloud.mapZ(y * depth_image.cols + x) - z_min) / bin_size];
+        }
     }
 
-    int dirs[] = { -1, 1, -width, width,
-                   -2, 2, -width * 2, width * 2};  // Also try one pixel skipped (filtering may cause some 1-pixel gaps)
-
-    for(unsigned int i_pixel = 0; i_pixel < width * height; ++i_pixel)
+    // A plane may fall on the border of two bins, so look at pairs of neighbouring bins
+    int i_best = 0;
+    int best_count = histogram[0];
+    for(int i = 1; i < (int)histogram.size(); ++i)
     {
-        float d = depth_image.at<float>(i_pixel);
+        int count = histogram[i - 1] + histogram[i];
+        if (count > best_count)
+        {
+            i_best = i;
+            best_count = count;
+        }
+    }
 
-        if (d == 0 || d != d)
-            continue;
+    if (best_count * 5 < num_points)
+        return false;
 
-        // Create cluster
-        clusters.push_back(EntityUpdate());
-        EntityUpdate& cluster = clusters.back();
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // Plane height is the average height of the points in the best bins
 
-        // Mark visited
-        visited.at<unsigned char>(i_pixel) = 1;
+    float z_begin = z_min + std::max(0, i_best - 1) * bin_size;
+    float z_end = z_min + (i_best + 1) * bin_size;
 
-        std::queue<unsigned int> Q;
-        Q.push(i_pixel);
+    double z_sum = 0;
+    int n = 0;
+    for(int y = r.y; y < r.y + r.height; ++y)
+    {
+        const float* d_row = depth_image.ptr<float>(y);
+        for(int x = r.x; x < r.x + r.width; ++x)
+        {
+            if (!(d_row[x] > 0))
+                continue;
 
-        while(!Q.empty())
+            float z = cloud.mapZ(y * depth_image.cols + x);
+            if (z >= z_begin && z <= z_end)
+            {
+                z_sum += z;
+                ++n;
+            }
+        }
+    }
+
+    float z_plane = z_sum / n;
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // Remove the plane points
+
+    for(int y = r.y; y < r.y + r.height; ++y)
+    {
+        float* d_row = depth_image.ptr<float>(y);
+        for(int x = r.x; x < r.x + r.width; ++x)
         {
-            unsigned int p1 = Q.front();
-            Q.pop();
+            if (d_row[x] > 0 && std::abs(cloud.mapZ(y * depth_image.cols + x) - z_plane) <= thickness)
+                d_row[x] = 0;
+        }
+    }
+
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void Segmenter::cluster(const cv::Mat& depth_image, const geo::DepthCamera& cam_model,
+                        const geo::Pose3D& sensor_pose, std::vector<EntityUpdate>& clusters) const
+{
+    RayTable rays;
+    rays.update(cam_model, depth_image.cols, depth_image.rows);
+
+    OrganizedPointCloud cloud;
+    cloud.setFrame(depth_image, rays, sensor_pose);
+
+    cluster(depth_image, cloud, cv::Rect(0, 0, depth_image.cols, depth_image.rows), clusters);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void Segmenter::cluster(const cv::Mat& depth_image, OrganizedPointCloud& cloud, const cv::Rect& roi,
+                        std::vector<EntityUpdate>& clusters, FrameArena* arena) const
+{
+    if (arena)
+        arena->reserve(0, 2);
+
+    int width = depth_image.cols;
+    int height = depth_image.rows;
+
+    // Only cluster within the ROI, and skip the 2-pixel image border
+    cv::Rect r = roi & cv::Rect(2, 2, width - 4, height - 4);
+    if (r.area() == 0)
+        return;
 
-            float p1_d = depth_image.at<float>(p1);
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // Label the connected components, in parallel stripes
+
+    // Label and size buffers are kept in the arena (if given) between frames
+    std::vector<int> local_parents, local_sizes;
+    std::vector<int>& parents = arena ? arena->intArray(0, r.area()) : local_parents;
+    std::vector<int>& sizes = arena ? arena->intArray(1, r.area()) : local_sizes;
+    parents.resize(r.area());
 
-            // Add to cluster
-            cluster.pixel_indices.push_back(p1);
-            cluster.points.push_back(cam_model.project2Dto3D(p1 % width, p1 / width) * p1_d);
+    unsigned int num_threads = std::max(1u, std::min<unsigned int>(num_threads_, r.height));
+    LabelJob job(depth_image, r, parents, num_threads);
+    runParallel(num_threads, job);
 
-            for(int dir = 0; dir < 8; ++dir)
+    // Connect the components across the stripe borders
+    for(unsigned int i_thread = 1; i_thread < num_threads; ++i_thread)
+    {
+        unsigned int y_begin, y_end;
+        partitionRange(r.height, num_threads, i_thread, y_begin, y_end);
+
+        for(int y = y_begin; y < (int)std::min(y_begin + 2, y_end); ++y)
+        {
+            for(int k = 1; k <= 2; ++k)
             {
-                unsigned int p2 = p1 + dirs[dir];
-                float p2_d = depth_image.at<float>(p2);
+                if (y - k >= (int)y_begin || y - k < 0)
+                    continue;
 
-                // If not yet visited, and depth is within bounds
-                if (visited.at<unsigned char>(p2) == 0 && std::abs<float>(p2_d - p1_d) < 0.05)
+                for(int x = 0; x < r.width; ++x)
                 {
-                    // Mark visited
-                    visited.at<unsigned char>(p2) = 1;
-
-                    // Add point to queue
-                    Q.push(p2);
+                    int i = y * r.width + x;
+                    int j = i - k * r.width;
+                    if (parents[i] >= 0 && parents[j] >= 0
+                            && connected(depth_image.at<float>(r.y + y, r.x + x), depth_image.at<float>(r.y + y - k, r.x + x)))
+                        unite(parents, i, j);
                 }
             }
         }
+    }
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // Determine component sizes. Since each parent has a lower index than its child, a single pass
+    // suffices to let all pixels point directly to their root
+
+    sizes.assign(r.area(), 0);
+    for(int i = 0; i < (int)parents.size(); ++i)
+    {
+        if (parents[i] < 0)
+            continue;
+
+        parents[i] = parents[parents[i]];
+        ++sizes[parents[i]];
+    }
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // Create clusters for the components that are large enough, in order of their first pixel
+
+    cloud.prepare(r);
+
+    unsigned int min_cluster_size = 100; // TODO: magic number
+
+    // Maps component root to cluster index (reuses the size buffer)
+    std::vector<int>& cluster_indices = sizes;
 
-        // Check if cluster has enough points. If not, remove it from the list
-        if (cluster.pixel_indices.size() < 100) // TODO: magic number
+    unsigned int i_cluster_start = clusters.size();
+    for(int i = 0; i < (int)parents.size(); ++i)
+    {
+        if (parents[i] != i)
+            continue;
+
+        if (sizes[i] < (int)min_cluster_size)
         {
-            clusters.pop_back();
+            cluster_indices[i] = -1;
             continue;
         }
 
+        clusters.push_back(EntityUpdate());
+        clusters.back().pixel_indices.reserve(sizes[i]);
+        clusters.back().points.reserve(sizes[i]);
+        cluster_indices[i] = clusters.size() - 1;
+    }
+
+    for(int y = 0; y < r.height; ++y)
+    {
+        for(int x = 0; x < r.width; ++x)
+        {
+            int i = y * r.width + x;
+            if (parents[i] < 0)
+                continue;
+
+            int i_cluster = cluster_indices[parents[i]];
+            if (i_cluster < 0)
+                continue;
+
+            int x_image = r.x + x;
+            int y_image = r.y + y;
+
+            int i_pixel = y_image * width + x_image;
+
+            EntityUpdate& cluster = clusters[i_cluster];
+            cluster.pixel_indices.push_back(i_pixel);
+            cluster.points.push_back(cloud.sensorPoint(i_pixel));
+        }
+    }
+
+    for(unsigned int i_cluster = i_cluster_start; i_cluster < clusters.size(); ++i_cluster)
+    {
+        EntityUpdate& cluster = clusters[i_cluster];
+
         // Calculate cluster convex hull
         float z_min = 1e9;
         float z_max = -1e9;
@@ -260,10 +833,8 @@ void Segmenter::cluster(const cv::Mat& depth_image, const geo::DepthCamera& cam_
         std::vector<geo::Vec2f> points_2d(cluster.points.size());
         for(unsigned int j = 0; j < cluster.points.size(); ++j)
         {
-            const geo::Vec3& p = cluster.points[j];
-
-            // Transform sensor point to map frame
-            geo::Vector3 p_map = sensor_pose * p;
+            // Sensor point in map frame
+            geo::Vector3 p_map = cloud.mapPoint(cluster.pixel_indices[j]);
 
             points_2d[j] = geo::Vec2f(p_map.x, p_map.y);
 
@@ -6,7 +6,7 @@
 
 #include <ed/helpers/depth_data_processing.h>
 
-#include <rgbd/View.h>
+#include <rgbd/Image.h>
 
 #include <tue/config/reader.h>
 
@@ -16,7 +16,9 @@
 #include <ed/serialization/serialization.h>
 
 #include "ed/kinect/association.h"
+#include "ed/kinect/parallel.h"
 #include "ed/kinect/renderer.h"
+#include "ed/kinect/world_overlay.h"
 
 #include "ed/convex_hull_calc.h"
 
@@ -24,7 +26,9 @@
 
 #include <ros/console.h>
 
+#include <algorithm>
 #include <cmath>
+#include <map>
 
 #include "ed/kinect/math_helper.h"
 
@@ -32,10 +36,17 @@
 // ----------------------------------------------------------------------------------------------------
 
 // Calculates which depth points are in the given convex hull (in the EntityUpdate), updates the mask,
-// and updates the convex hull height based on the points found
-void refitConvexHull(const rgbd::Image& image, const geo::Pose3D& sensor_pose, const geo::DepthCamera& cam_model,
-                     const Segmenter& segmenter_, EntityUpdate& up)
+// and updates the convex hull height based on the points found. If 'shrink' is given, the points less than
+// 'shrink' above the lowest point found are left out afterwards. This gives the same result as refitting a
+// second time with z_min raised by 'shrink', without testing all points again. Only reads the level (the
+// points are calculated here instead of taken from the level's point cloud), so multiple updates can be
+// refit concurrently. In that case, pass num_threads = 1. If a buffer is given (a float image at least as
+// large as the level), it is used to store the filtered points.
+void refitConvexHull(const DepthLevel& level, const Segmenter& segmenter_, EntityUpdate& up, double shrink = 0,
+                     unsigned int num_threads = 0, const cv::Mat& buffer = cv::Mat())
 {
+    const geo::Pose3D& sensor_pose = level.cloud.sensorPose();
+
     up.pose_map.t.z += (up.chull.z_max + up.chull.z_min) / 2;
 
     geo::Shape chull_shape;
@@ -44,8 +55,11 @@ void refitConvexHull(const rgbd::Image& image, const geo::Pose3D& sensor_pose, c
         points[i] = geo::Vec2(up.chull.points[i].x, up.chull.points[i].y);
     geo::createConvexPolygon(chull_shape, points, up.chull.height());
 
-    cv::Mat filtered_depth_image;
-    segmenter_.calculatePointsWithin(image, chull_shape, sensor_pose.inverse() * up.pose_map, filtered_depth_image);
+    // Only the image area the convex hull projects to is considered
+    cv::Mat filtered_window = buffer;
+    cv::Rect roi;
+    segmenter_.calculatePointsWithinWindow(level.depth, level.cam, chull_shape, sensor_pose.inverse() * up.pose_map,
+                                           filtered_window, roi, num_threads);
 
     up.points.clear();
     up.pixel_indices.clear();
@@ -53,30 +67,56 @@ void refitConvexHull(const rgbd::Image& image, const geo::Pose3D& sensor_pose, c
     float z_min =  1e9;
     float z_max = -1e9;
 
-    int i_pixel = 0;
-    for(int y = 0; y < filtered_depth_image.rows; ++y)
+    for(int y = 0; y < roi.height; ++y)
     {
-        for(int x = 0; x < filtered_depth_image.cols; ++x)
+        const float* d_row = filtered_window.ptr<float>(y);
+        float ry = level.rays.y(roi.y + y);
+
+        for(int x = 0; x < roi.width; ++x)
         {
-            float d = filtered_depth_image.at<float>(y, x);
+            float d = d_row[x];
             if (d == 0)
-            {
-                ++i_pixel;
                 continue;
-            }
 
-            geo::Vec3 p = cam_model.project2Dto3D(x, y) * d;
-            geo::Vec3 p_map = sensor_pose * p;
+            geo::Vec3 p(level.rays.x(roi.x + x) * d, ry * d, -d);
+            float z = sensor_pose.R.zx * p.x + sensor_pose.R.zy * p.y + sensor_pose.R.zz * p.z + sensor_pose.t.z;
 
-            z_min = std::min<float>(z_min, p_map.z);
-            z_max = std::max<float>(z_max, p_map.z);
+            z_min = std::min<float>(z_min, z);
+            z_max = std::max<float>(z_max, z);
 
-            up.pixel_indices.push_back(i_pixel);
+            up.pixel_indices.push_back((roi.y + y) * level.depth.cols + roi.x + x);
             up.points.push_back(p);
-            ++i_pixel;
         }
     }
 
+    if (shrink > 0 && !up.pixel_indices.empty())
+    {
+        // Keep the points at least 'shrink' above the lowest point (in place)
+        float z_threshold = z_min + shrink;
+
+        z_min =  1e9;
+        z_max = -1e9;
+
+        unsigned int n = 0;
+        for(unsigned int i = 0; i < up.points.size(); ++i)
+        {
+            const geo::Vec3& p = up.points[i];
+            float z = sensor_pose.R.zx * p.x + sensor_pose.R.zy * p.y + sensor_pose.R.zz * p.z + sensor_pose.t.z;
+            if (z < z_threshold)
+                continue;
+
+            z_min = std::min<float>(z_min, z);
+            z_max = std::max<float>(z_max, z);
+
+            up.pixel_indices[n] = up.pixel_indices[i];
+            up.points[n] = p;
+            ++n;
+        }
+
+        up.pixel_indices.resize(n);
+        up.points.resize(n);
+    }
+
     double h = z_max - z_min;
     up.pose_map.t.z = (z_max + z_min) / 2;
     up.chull.z_min = -h / 2;
@@ -85,118 +125,259 @@ void refitConvexHull(const rgbd::Image& image, const geo::Pose3D& sensor_pose, c
 
 // ----------------------------------------------------------------------------------------------------
 /**
- * @brief mergeConvexHulls, creating a new convexHull around the two objects. Working in both XY and Z.
- * @param u1 EntityUpdate used as starting point
- * @param u2 Merge points into u1
- * @return new EntityUpdate including new convexHull and measurement points of both inputs.
+ * @brief mergeConvexHulls, creating a new convexHull around a group of objects. Working in both XY and Z.
+ * @param updates all updates
+ * @param group indices of the updates to merge. The first one is used as starting point
+ * @param new_u will contain the new convexHull and the measurement points within it
  */
-EntityUpdate mergeConvexHulls(const rgbd::Image& image, const geo::Pose3D& sensor_pose, const geo::DepthCamera& cam_model,
-                              const Segmenter& segmenter_, const EntityUpdate& u1, const EntityUpdate& u2)
+void mergeConvexHulls(const DepthLevel& level, const Segmenter& segmenter_, std::vector<EntityUpdate>& updates,
+                      const std::vector<int>& group, EntityUpdate& new_u, const cv::Mat& buffer)
 {
-    EntityUpdate new_u = u1;
-    double z_max = std::max(u1.pose_map.t.getZ()+u1.chull.z_max,u2.pose_map.t.getZ()+u2.chull.z_max);
-    double z_min = std::min(u1.pose_map.t.getZ()+u1.chull.z_min,u2.pose_map.t.getZ()+u2.chull.z_min);
+    double z_max = -1e9;
+    double z_min = 1e9;
 
-    std::vector<geo::Vec2f> points(u1.chull.points.size()+u2.chull.points.size());
-    for (unsigned int p = 0; p < u1.chull.points.size(); ++p)
-    {
-        geo::Vec3 p_map = u1.pose_map * geo::Vec3(u1.chull.points[p].x, u1.chull.points[p].y, 0);
-        points[p] = geo::Vec2f(p_map.x, p_map.y);
-    }
-    unsigned int offset = u1.chull.points.size();
-    for (unsigned int p = 0; p < u2.chull.points.size(); ++p)
+    std::vector<geo::Vec2f> points;
+    for(std::vector<int>::const_iterator it = group.begin(); it != group.end(); ++it)
     {
-        geo::Vector3 p_map = u2.pose_map * geo::Vec3(u2.chull.points[p].x, u2.chull.points[p].y, 0);
-        points[p + offset] = geo::Vec2f(p_map.x, p_map.y);
+        const EntityUpdate& u = updates[*it];
+        z_max = std::max(z_max, u.pose_map.t.getZ() + u.chull.z_max);
+        z_min = std::min(z_min, u.pose_map.t.getZ() + u.chull.z_min);
+
+        for (unsigned int p = 0; p < u.chull.points.size(); ++p)
+        {
+            geo::Vec3 p_map = u.pose_map * geo::Vec3(u.chull.points[p].x, u.chull.points[p].y, 0);
+            points.push_back(geo::Vec2f(p_map.x, p_map.y));
+        }
     }
 
-    ed::convex_hull::create(points, z_min, z_max, new_u.chull, new_u.pose_map);
-    refitConvexHull(image, sensor_pose, cam_model, segmenter_, new_u);
+    // Take over the association of the first update. The points are re-calculated by the refit anyway.
+    EntityUpdate& u1 = updates[group.front()];
+    new_u.is_new = u1.is_new;
+    new_u.id = u1.id;
 
-    return new_u;
+    ed::convex_hull::create(points, z_min, z_max, new_u.chull, new_u.pose_map);
+    refitConvexHull(level, segmenter_, new_u, 0, 0, buffer);
 }
 
 // ----------------------------------------------------------------------------------------------------
 
-// Calculates which depth points are in the given convex hull (in the EntityUpdate), updates the mask,
-// and updates the convex hull height based on the points found
-std::vector<EntityUpdate> mergeOverlappingConvexHulls(const rgbd::Image& image, const geo::Pose3D& sensor_pose, const geo::DepthCamera& cam_model,
-                                                         const Segmenter& segmenter_, const std::vector<EntityUpdate>& updates)
+int findGroup(std::vector<int>& parents, int i)
 {
+    while (parents[i] != i)
+    {
+        parents[i] = parents[parents[i]];
+        i = parents[i];
+    }
+    return i;
+}
 
-  ROS_INFO("mergoverlapping chulls: nr of updates: %lu", updates.size());
+// ----------------------------------------------------------------------------------------------------
 
-  // Updated convex hulls
-  std::vector<EntityUpdate> new_updates;
+// Merges the updates of which the convex hulls overlap in XY (transitively: if A overlaps B and B overlaps C,
+// A, B and C are merged). For each group of overlapping updates a single convex hull is created and refit.
+// Groups keep the position of their first update, so the result does not depend on the order of the tests.
+void mergeOverlappingConvexHulls(const DepthLevel& level, const Segmenter& segmenter_, std::vector<EntityUpdate>& updates,
+                                 const cv::Mat& buffer)
+{
+    ROS_INFO("mergoverlapping chulls: nr of updates: %lu", updates.size());
 
-  // Keep track of indices that did collide, skip them in i
-  std::vector<int> collided_indices;
-  std::map<int, std::vector<int> > collission_map;
+    int n = updates.size();
+    if (n < 2)
+        return;
 
-  for (int i = 0; i < updates.size(); ++i)
-  {
-    const EntityUpdate& u1 = updates[i];
+    // Bounding boxes in XY, in the same frame as used by ed::convex_hull::collide
+    std::vector<geo::Vec2f> bb_min(n), bb_max(n);
+    for(int i = 0; i < n; ++i)
+    {
+        const EntityUpdate& u = updates[i];
+        geo::Vec2f& b_min = bb_min[i];
+        geo::Vec2f& b_max = bb_max[i];
+        b_min = geo::Vec2f(1e9, 1e9);
+        b_max = geo::Vec2f(-1e9, -1e9);
+        for(std::vector<geo::Vec2f>::const_iterator it = u.chull.points.begin(); it != u.chull.points.end(); ++it)
+        {
+            b_min.x = std::min<float>(b_min.x, it->x + u.pose_map.t.x);
+            b_min.y = std::min<float>(b_min.y, it->y + u.pose_map.t.y);
+            b_max.x = std::max<float>(b_max.x, it->x + u.pose_map.t.x);
+            b_max.y = std::max<float>(b_max.y, it->y + u.pose_map.t.y);
+        }
+    }
 
-    // If index already collided, it will be merged to another one
-    if (std::find(collided_indices.begin(), collided_indices.end(), i) != collided_indices.end())
+    // Broad phase: register the updates in a grid, such that only updates that share a cell are tested
+    const float cell_size = 0.25;
+    std::map<std::pair<int, int>, std::vector<int> > grid;
+    for(int i = 0; i < n; ++i)
     {
-      continue;
+        if (bb_min[i].x > bb_max[i].x)
+            continue;  // no points
+
+        for(int cx = std::floor(bb_min[i].x / cell_size); cx <= std::floor(bb_max[i].x / cell_size); ++cx)
+            for(int cy = std::floor(bb_min[i].y / cell_size); cy <= std::floor(bb_max[i].y / cell_size); ++cy)
+                grid[std::make_pair(cx, cy)].push_back(i);
     }
 
-    for (int j = 0; j < updates.size(); ++j)
+    std::vector<int> parents(n);
+    for(int i = 0; i < n; ++i)
+        parents[i] = i;
+
+    for(std::map<std::pair<int, int>, std::vector<int> >::const_iterator it = grid.begin(); it != grid.end(); ++it)
     {
-    // skip self
-        if (i == j)
-            continue;
+        const std::vector<int>& cell = it->second;
+        for(unsigned int k1 = 0; k1 < cell.size(); ++k1)
+        {
+            int i = cell[k1];
+            for(unsigned int k2 = k1 + 1; k2 < cell.size(); ++k2)
+            {
+                int j = cell[k2];
+
+                // Bounding boxes must overlap
+                float x_min = std::max(bb_min[i].x, bb_min[j].x);
+                float y_min = std::max(bb_min[i].y, bb_min[j].y);
+                if (x_min > std::min(bb_max[i].x, bb_max[j].x) || y_min > std::min(bb_max[i].y, bb_max[j].y))
+                    continue;
+
+                // Only test each pair once: in the cell that contains the corner of the overlapping area
+                if (std::floor(x_min / cell_size) != it->first.first || std::floor(y_min / cell_size) != it->first.second)
+                    continue;
+
+                int root_i = findGroup(parents, i);
+                int root_j = findGroup(parents, j);
+                if (root_i == root_j)
+                    continue;
+
+                const EntityUpdate& u1 = updates[i];
+                const EntityUpdate& u2 = updates[j];
 
-      const EntityUpdate& u2 = updates[j];
-
-      // If we collide, update the i convex hull
-      if (ed::convex_hull::collide(u1.chull, u1.pose_map.t, u2.chull, u2.pose_map.t, 0, 1e6))  // This should prevent multiple entities above each other;1e6 is ok, because objects in other areas are ignored.
-      {
-        ROS_DEBUG("Collition item %i with %i", i, j);
-        ROS_DEBUG("Item %i: xyz: %.2f, %.2f, %.2f, z_min: %.2f, z_max: %.2f", i, u1.pose_map.t.getX(), u1.pose_map.t.getY(), u1.pose_map.t.getZ(), u1.chull.z_min, u1.chull.z_max);
-        ROS_DEBUG("Item %i: xyz: %.2f, %.2f, %.2f, z_min: %.2f, z_max: %.2f", j, u2.pose_map.t.getX(), u2.pose_map.t.getY(), u2.pose_map.t.getZ(), u2.chull.z_min, u2.chull.z_max);
-        collission_map[i].push_back(j);
-        collided_indices.push_back(j);
-      }
+                if (ed::convex_hull::collide(u1.chull, u1.pose_map.t, u2.chull, u2.pose_map.t, 0, 1e6))  // This should prevent multiple entities above each other;1e6 is ok, because objects in other areas are ignored.
+                {
+                    ROS_DEBUG("Collition item %i with %i", i, j);
+                    ROS_DEBUG("Item %i: xyz: %.2f, %.2f, %.2f, z_min: %.2f, z_max: %.2f", i, u1.pose_map.t.getX(), u1.pose_map.t.getY(), u1.pose_map.t.getZ(), u1.chull.z_min, u1.chull.z_max);
+                    ROS_DEBUG("Item %i: xyz: %.2f, %.2f, %.2f, z_min: %.2f, z_max: %.2f", j, u2.pose_map.t.getX(), u2.pose_map.t.getY(), u2.pose_map.t.getZ(), u2.chull.z_min, u2.chull.z_max);
+
+                    // The lowest index becomes the root, such that each group is represented by its first update
+                    parents[std::max(root_i, root_j)] = std::min(root_i, root_j);
+                }
+            }
+        }
     }
-  }
 
-  // Now again loop over the updates and only push back in the new updates if it will not be merged into an other entity
-  for (int i = 0; i < updates.size(); ++i)
-  {
-    // If index in collided_indices, it will be merged to another one
-    if (std::find(collided_indices.begin(), collided_indices.end(), i) == collided_indices.end())
+    // Collect the groups, in order of their first update
+    std::vector<std::vector<int> > groups;
+    std::vector<int> group_index(n, -1);
+    for(int i = 0; i < n; ++i)
     {
-      // Merging is done by creating a new convexHull. Multiple objects can be merged into one.
-      // No sorting is done. So depending on which entity was taken first, that one is used as basis for merging.
-      // But that shouldn't matter, only for UUID. Although the entities are re-associatied afterwards.
-      // Which match new measurments to old entities.
-
-      EntityUpdate u1 = updates[i];
-      for (std::vector<int>::iterator it = collission_map[i].begin(); it != collission_map[i].end(); ++it)
-      {
-          ROS_DEBUG_COND(it == collission_map[i].begin(), "Merging entity %i and xx", i);
-          ROS_DEBUG("Merging entity %i and %i", i, *it);
-          const EntityUpdate u2 = updates[*it];
-          u1 = mergeConvexHulls(image, sensor_pose, cam_model, segmenter_, u1, u2);
-
-      }
-      new_updates.push_back(u1);
-      ROS_DEBUG("Adding update of entity %i", i);
+        int root = findGroup(parents, i);
+        if (group_index[root] < 0)
+        {
+            group_index[root] = groups.size();
+            groups.push_back(std::vector<int>());
+        }
+        groups[group_index[root]].push_back(i);
     }
-    else
+
+    if (groups.size() == updates.size())
+        return;
+
+    std::vector<EntityUpdate> new_updates(groups.size());
+    for(unsigned int i = 0; i < groups.size(); ++i)
     {
-        ROS_DEBUG("Skipping update %i because of collision", i);
+        const std::vector<int>& group = groups[i];
+        if (group.size() == 1)
+        {
+            // Nothing to merge, take over the update as is (without copying the points)
+            EntityUpdate& u = updates[group.front()];
+            EntityUpdate& new_u = new_updates[i];
+            new_u.is_new = u.is_new;
+            new_u.id = u.id;
+            new_u.pixel_indices.swap(u.pixel_indices);
+            new_u.points.swap(u.points);
+            new_u.chull = u.chull;
+            new_u.pose_map = u.pose_map;
+        }
+        else
+        {
+            ROS_DEBUG("Merging %lu entities into entity %i", group.size(), group.front());
+            mergeConvexHulls(level, segmenter_, updates, group, new_updates[i], buffer);
+        }
+    }
+
+    updates.swap(new_updates);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Converts the pixel indices of the update from the resolution of the given level to the full resolution.
+// Each pixel is replaced by the block of full resolution pixels it covers.
+void upsamplePixelIndices(const DepthLevel& level, int width, int height, EntityUpdate& up)
+{
+    int level_width = level.depth.cols;
+    int level_height = level.depth.rows;
+
+    if (level_width == width && level_height == height)
+        return;
+
+    std::vector<unsigned int> pixel_indices;
+    pixel_indices.reserve(up.pixel_indices.size() * (width / level_width + 1) * (height / level_height + 1));
+
+    for(std::vector<unsigned int>::const_iterator it = up.pixel_indices.begin(); it != up.pixel_indices.end(); ++it)
+    {
+        int x = *it % level_width;
+        int y = *it / level_width;
+
+        int x_begin = x * width / level_width;
+        int x_end = (x + 1) * width / level_width;
+        int y_begin = y * height / level_height;
+        int y_end = (y + 1) * height / level_height;
+
+        for(int y_full = y_begin; y_full < y_end; ++y_full)
+            for(int x_full = x_begin; x_full < x_end; ++x_full)
+                pixel_indices.push_back(y_full * width + x_full);
     }
-  }
 
-  return new_updates;
+    up.pixel_indices.swap(pixel_indices);
 }
 
 // ----------------------------------------------------------------------------------------------------
 
+// Extends the convex hulls a bit towards the supporting surface, refits them, and upsamples the masks to
+// the given resolution. The updates are divided over the threads (each refit itself runs single-threaded).
+// Every update is only written by the thread that handles it, so the order of the updates is kept. Thread
+// i uses image slot 1 + i of the arena.
+struct RefitJob
+{
+    RefitJob(const DepthLevel& level_, const Segmenter& segmenter_, int width_, int height_,
+             std::vector<EntityUpdate>& updates_, FrameArena& arena_, unsigned int num_threads_)
+        : level(level_), segmenter(segmenter_), width(width_), height(height_), updates(updates_), arena(arena_),
+          num_threads(num_threads_) {}
+
+    void operator()(unsigned int i_thread)
+    {
+        cv::Mat buffer = arena.floatImage(1 + i_thread, level.depth.rows, level.depth.cols);
+
+        // Interleave the updates over the threads, as neighbouring clusters often have similar sizes
+        for(unsigned int i = i_thread; i < updates.size(); i += num_threads)
+        {
+            EntityUpdate& up = updates[i];
+
+            up.chull.z_min -= 0.04;
+            refitConvexHull(level, segmenter, up, 0.01, num_threads > 1 ? 1 : 0, buffer);
+
+            // The masks are used at full resolution
+            upsamplePixelIndices(level, width, height, up);
+        }
+    }
+
+    const DepthLevel& level;
+    const Segmenter& segmenter;
+    int width;
+    int height;
+    std::vector<EntityUpdate>& updates;
+    FrameArena& arena;
+    unsigned int num_threads;
+};
+
+// ----------------------------------------------------------------------------------------------------
+
 Updater::Updater()
 {
 }
@@ -209,6 +390,57 @@ Updater::~Updater()
 
 // ----------------------------------------------------------------------------------------------------
 
+geo::ShapeConstPtr Updater::getAreaShape(const ed::EntityConstPtr& e, const std::string& area_name)
+{
+    const tue::config::DataConstPointer& data = e->data();
+
+    CachedArea& cached = area_cache_[std::make_pair(e->id(), area_name)];
+    if (cached.shape && cached.data.data == data.data && cached.data.root_ == data.root_)
+        return cached.shape;
+
+    // Parse the area from the entity data
+    geo::ShapePtr shape;
+    tue::config::Reader r(e->data());
+
+    if (r.readArray("areas"))
+    {
+        while(r.nextArrayItem())
+        {
+            std::string a_name;
+            if (!r.value("name", a_name) || a_name != area_name)
+                continue;
+
+            geo::ShapePtr area_shape(new geo::Shape);
+            if (ed::deserialize(r, "shape", *area_shape))
+            {
+                shape = area_shape;
+                break;
+            }
+        }
+
+        r.endArray();
+    }
+
+    cached.data = data;
+    cached.shape = shape;
+
+    return shape;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void Updater::pruneAreaCache(const ed::WorldModel& world)
+{
+    for(std::map<std::pair<ed::UUID, std::string>, CachedArea>::iterator it = area_cache_.begin(); it != area_cache_.end();)
+    {
+        if (world.getEntity(it->first.first))
+            ++it;
+        else
+            area_cache_.erase(it++);
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
 
 bool Updater::update(const ed::WorldModel& world, const rgbd::ImageConstPtr& image, const geo::Pose3D& sensor_pose_const,
                      const UpdateRequest& req, UpdateResult& res, bool apply_roi)
@@ -219,15 +451,29 @@ bool Updater::update(const ed::WorldModel& world, const rgbd::ImageConstPtr& ima
     // will contain depth image filtered with given update shape and world model (background) subtraction
     cv::Mat filtered_depth_image;
 
-    // sensor pose might be update, so copy (making non-const)
-    geo::Pose3D sensor_pose = sensor_pose_const;
+    // image area that contains all points of filtered_depth_image
+    cv::Rect roi;
+
+    // area in which the segmentation should take place (if any)
+    bool has_area = false;
+    geo::ShapeConstPtr area_shape;
+    geo::Pose3D area_pose;
+
+    // Camera model, sensor pose and the depth image levels (with their point clouds) are derived once for
+    // this frame. The levels are calculated on demand
+    frame_.setFrame(image, sensor_pose_const);
 
-    // depth image
-    const cv::Mat& depth = image->getDepthImage();
+    // sensor pose might be updated (through the frame context)
+    const geo::Pose3D& sensor_pose = frame_.sensorPose();
 
-    // Determine depth image camera model
-    rgbd::View view(*image, depth.cols);
-    const geo::DepthCamera& cam_model = view.getRasterizer();
+    // depth image and camera model
+    const cv::Mat& depth = frame_.depth();
+    const geo::DepthCamera& cam_model = frame_.cam();
+
+    // Temporary buffers are taken from the arena: image slot 0 for the filtered depth image, slots 1 and up
+    // for the refits (one per thread), and array slots 0 and 1 for clustering
+    arena_.newFrame();
+    arena_.reserve(1 + segmenter_.numThreads(), 2);
 
     std::string area_description;
 
@@ -289,7 +535,6 @@ bool Updater::update(const ed::WorldModel& world, const rgbd::ImageConstPtr& ima
 
         if (fit_supporting_entity)
         {
-            FitterData fitter_data;
             if(apply_roi && e->has_roi())
             {
                 //The ROI values are local to the object description in the YAML (no world context).
@@ -298,15 +543,21 @@ bool Updater::update(const ed::WorldModel& world, const rgbd::ImageConstPtr& ima
                 float min = e->ROI()->min + pose.t.z;
                 float max = e->ROI()->max + pose.t.z;
 
-                fitter_.processSensorData(*image, sensor_pose, fitter_data, e->ROI()->include, min, max);
+                fitter_.processSensorData(frame_.level(req.downsample_factors.fitting).cloud, fitter_data_,
+                                          e->ROI()->include, min, max);
             }
             else
             {
-                fitter_.processSensorData(*image, sensor_pose, fitter_data);
+                fitter_.processSensorData(frame_.level(req.downsample_factors.fitting).cloud, fitter_data_);
             }
 
-            if (fitter_.estimateEntityPose(fitter_data, world, entity_id, e->pose(), new_pose, req.max_yaw_change, apply_roi))
+            FitterRefinement refinement;
+            if (fitter_.estimateEntityPose(fitter_data_, world, entity_id, e->pose(), new_pose, req.max_yaw_change, apply_roi,
+                                           &refinement))
             {
+                ROS_DEBUG("Fitted %s: %d refinement iteration(s), %s, %s", entity_id.c_str(), refinement.iterations,
+                          refinement.converged ? "converged" : "not converged", refinement.accepted ? "accepted" : "rejected");
+
                 bool hasStateUpdateGroup = !e->stateUpdateGroup().empty();
                 if(apply_roi && hasStateUpdateGroup)
                 {
@@ -347,7 +598,9 @@ bool Updater::update(const ed::WorldModel& world, const rgbd::ImageConstPtr& ima
 
         if (false)
         {
-            fitZRP(*e->shape(), new_pose, *image, sensor_pose_const, sensor_pose);
+            geo::Pose3D corrected_sensor_pose;
+            fitZRP(*e->shape(), new_pose, *image, sensor_pose_const, corrected_sensor_pose);
+            frame_.setSensorPose(corrected_sensor_pose);
 
             ROS_DEBUG_STREAM("Old sensor pose: " << sensor_pose_const);
             ROS_DEBUG_STREAM("New sensor pose: " << sensor_pose);
@@ -360,62 +613,77 @@ bool Updater::update(const ed::WorldModel& world, const rgbd::ImageConstPtr& ima
         {
             // Determine segmentation area (the geometrical shape in which the segmentation should take place)
 
-            geo::Shape shape;
-            bool found = false;
-            tue::config::Reader r(e->data());
-
-            if (r.readArray("areas"))
-            {
-                while(r.nextArrayItem())
-                {
-                    std::string a_name;
-                    if (!r.value("name", a_name) || a_name != area_name)
-                        continue;
-
-                    if (ed::deserialize(r, "shape", shape))
-                    {
-                        found = true;
-                        break;
-                    }
-                }
-
-                r.endArray();
-            }
+            pruneAreaCache(world);
+            area_shape = getAreaShape(e, area_name);
 
-            if (!found)
+            if (!area_shape)
             {
                 res.error << "No area '" << area_name << "' for entity '" << entity_id.str() << "'.";
                 return false;
             }
-            else if (shape.getMesh().getTriangleIs().empty())
+            else if (area_shape->getMesh().getTriangleIs().empty())
             {
                 res.error << "Could not load shape of area '" << area_name << "' for entity '" << entity_id.str() << "'.";
                 return false;
             }
 
-            // - - - - - - - - - - - - - - - - - - - - - - - -
-            // Segment
-
-            geo::Pose3D shape_pose = sensor_pose.inverse() * new_pose;
-            segmenter_.calculatePointsWithin(*image, shape, shape_pose, filtered_depth_image);
+            has_area = true;
+            area_pose = frame_.sensorPoseInv() * new_pose;
         }
     }
-    else
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // Segment and remove background
+
+    // The world model may have been updated above, but the changes (new poses) are only captured in
+    // an update request. Therefore, use an overlay of the world model with these poses for the
+    // background removal
+
+    WorldOverlay world_updated(world);
+    world_updated.setPoses(res.update_req.poses);
+
+    DepthLevel& segmentation_level = frame_.level(req.downsample_factors.segmentation);
+
+    bool background_rendered = true;
+
+    if (has_area)
     {
-        filtered_depth_image = image->getDepthImage().clone();
+        // Only keep the points within the area that are not part of the background, in one pass
+        filtered_depth_image = arena_.floatImage(0, segmentation_level.depth.rows, segmentation_level.depth.cols);
+        segmenter_.calculatePointsWithinAndRemoveBackground(segmentation_level.depth, segmentation_level.cam, *area_shape, area_pose,
+                                                            world_updated, sensor_pose, req.background_padding,
+                                                            filtered_depth_image, roi);
     }
+    else
+    {
+        if (req.area_description.empty())
+        {
+            filtered_depth_image = arena_.floatImage(0, segmentation_level.depth.rows, segmentation_level.depth.cols);
+            segmentation_level.depth.copyTo(filtered_depth_image);
+            roi = cv::Rect(0, 0, filtered_depth_image.cols, filtered_depth_image.rows);
+        }
 
-    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-    // Remove background
+        // With an entity-only area description, there is no image to filter. Do not render the background then, as
+        // that would replace the cached render with an empty one.
+        if (!filtered_depth_image.empty() && roi.area() > 0)
+            segmenter_.removeBackground(filtered_depth_image, world_updated, segmentation_level.cam, sensor_pose,
+                                        req.background_padding, roi);
+        else
+            background_rendered = false;
+    }
 
-    // The world model may have been updated above, but the changes are only captured in
-    // an update request. Therefore, make a (shallow) copy of the world model and apply
-    // the changes, and use this for the background removal
+    const BackgroundRenderer& background = segmenter_.backgroundRenderer();
 
-    ed::WorldModel world_updated = world;
-    world_updated.update(res.update_req);
+    if (background_rendered)
+    {
+        const BackgroundRenderStats& render_stats = background.stats();
+        ROS_DEBUG("Background render cache: %u hits, %u partial hits, %u misses",
+                  render_stats.hits, render_stats.partial_hits, render_stats.misses);
 
-    segmenter_.removeBackground(filtered_depth_image, world_updated, cam_model, sensor_pose, req.background_padding);
+        // Not copied: the renderer keeps its buffers between updates, so this is only valid until the next update
+        res.background_entity_index = background.entityIndexImage();
+        res.background_entity_ids = background.entityIds();
+    }
 
     // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
     // Clear convex hulls that are no longer there
@@ -448,32 +716,35 @@ bool Updater::update(const ed::WorldModel& world, const rgbd::ImageConstPtr& ima
 //    cv::imshow("segments", filtered_depth_image / 10);
 //    cv::waitKey();
 
+    // - - - - - - - - - - - - - - - - - - - - - - - -
+    // Remove the supporting surface, such that it does not end up in (or as) a cluster
+    if (req.supporting_plane_thickness > 0)
+        segmenter_.removeSupportingPlane(filtered_depth_image, segmentation_level.cloud, roi, req.supporting_plane_thickness);
+
     // - - - - - - - - - - - - - - - - - - - - - - - -
     // Cluster
-    segmenter_.cluster(filtered_depth_image, cam_model, sensor_pose, res.entity_updates);
+    segmenter_.cluster(filtered_depth_image, segmentation_level.cloud, roi, res.entity_updates, &arena_);
+
+    DepthLevel& refit_level = frame_.level(req.downsample_factors.refit);
 
     // - - - - - - - - - - - - - - - - - - - - - - - -
     // Merge the detected clusters if they overlap in XY or Z
-    res.entity_updates = mergeOverlappingConvexHulls(*image, sensor_pose, cam_model, segmenter_, res.entity_updates);
+    mergeOverlappingConvexHulls(refit_level, segmenter_, res.entity_updates,
+                                arena_.floatImage(1, refit_level.depth.rows, refit_level.depth.cols));
 
     // - - - - - - - - - - - - - - - - - - - - - - - -
     // Increase the convex hulls a bit towards the supporting surface and re-calculate mask
-    // Then shrink the convex hulls again to get rid of the surface pixels
+    // Then shrink the convex hulls again to get rid of the surface pixels (in the same refit)
 
-    for(std::vector<EntityUpdate>::iterator it = res.entity_updates.begin(); it != res.entity_updates.end(); ++it)
-    {
-        EntityUpdate& up = *it;
-
-        up.chull.z_min -= 0.04;
-        refitConvexHull(*image, sensor_pose, cam_model, segmenter_, up);
+    unsigned int num_threads = std::max(1u, std::min<unsigned int>(segmenter_.numThreads(), res.entity_updates.size()));
+    RefitJob refit_job(refit_level, segmenter_, depth.cols, depth.rows, res.entity_updates, arena_, num_threads);
+    runParallel(num_threads, refit_job);
 
-        up.chull.z_min += 0.01;
-        refitConvexHull(*image, sensor_pose, cam_model, segmenter_, up);
-    }
+    ROS_DEBUG("Frame arena: %u slot growths in this update", arena_.numGrowths());
 
     // - - - - - - - - - - - - - - - - - - - - - - - -
     // Perform association and update
-    associateAndUpdate(associatable_entities, image, sensor_pose, res.entity_updates, res.update_req);
+    associateAndUpdate(associatable_entities, frame_, res.entity_updates, res.update_req);
 
     // - - - - - - - - - - - - -  - - - - - - - -  - - -
     // Remove entities that are not associated
@@ -482,7 +753,7 @@ bool Updater::update(const ed::WorldModel& world, const rgbd::ImageConstPtr& ima
         ed::EntityConstPtr e = *it;
 
         // Check if entity is in frustum
-        geo::Vec3 p_3d = sensor_pose.inverse() * e->pose().t;
+        geo::Vec3 p_3d = frame_.sensorPoseInv() * e->pose().t;
         cv::Point p_2d = cam_model.project3Dto2D(p_3d);
         if (p_2d.x < 0 || p_2d.y < 0 || p_2d.x >= depth.cols || p_2d.y >= depth.rows)
             continue;
@@ -377,12 +377,15 @@ void LaserPlugin::update(const ed::WorldModel& world, const sensor_msgs::LaserSc
 
     geo::Pose3D sensor_pose_inv = sensor_pose.inverse();
 
+    // Only render entities that intersect the laser plane within the laser range
+    culler_.setPlanarView(sensor_pose, scan->angle_min, scan->angle_max, scan->range_max, true);
+
     std::vector<double> model_ranges(num_beams, 0);
     for(ed::WorldModel::const_iterator it = world.begin(); it != world.end(); ++it)
     {
         const ed::EntityConstPtr& e = *it;
 
-        if (e->shape() && e->has_pose() && !(e->hasType("left_door") || e->hasType("door_left") || e->hasType("right_door") || e->hasType("door_right")))
+        if (culler_.isVisible(e) && !(e->hasType("left_door") || e->hasType("door_left") || e->hasType("right_door") || e->hasType("door_right")))
         {
             // Set render options
             geo::LaserRangeFinder::RenderOptions opt;
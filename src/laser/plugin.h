@@ -19,6 +19,8 @@
 // Properties
 #include "ed/convex_hull.h"
 
+#include "ed_sensor_integration/entity_culler.h"
+
 
 // ----------------------------------------------------------------------------------------------------
 
@@ -49,6 +51,8 @@ private:
 
     geo::LaserRangeFinder lrf_model_;
 
+    ed_sensor_integration::EntityCuller culler_;
+
     void scanCallback(const sensor_msgs::LaserScan::ConstPtr& msg);
 
     void update(const ed::WorldModel& world, const sensor_msgs::LaserScan::ConstPtr& scan,
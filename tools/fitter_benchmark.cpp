@@ -0,0 +1,278 @@
+#include <ed/kinect/fitter.h>
+
+#include <ed/world_model.h>
+#include <ed/update_request.h>
+#include <ed/entity.h>
+#include <ed/uuid.h>
+
+#include <geolib/Box.h>
+
+#include <tue/profiling/timer.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <string>
+
+// ----------------------------------------------------------------------------------------------------
+
+// Counts all heap allocations of the process
+static unsigned long num_allocations = 0;
+
+void* operator new(std::size_t size) throw(std::bad_alloc)
+{
+    ++num_allocations;
+    void* p = std::malloc(size == 0 ? 1 : size);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) throw()
+{
+    std::free(p);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Creates a world with a cabinet in front of the sensor, and two boxes next to it
+void createWorld(const geo::Pose3D& cabinet_pose, ed::WorldModel& world)
+{
+    ed::UpdateRequest req;
+
+    req.setShape("cabinet", geo::ShapePtr(new geo::Box(geo::Vec3(-0.3, -0.6, 0), geo::Vec3(0.3, 0.6, 0.8))));
+    req.setPose("cabinet", cabinet_pose);
+
+    req.setShape("box-1", geo::ShapePtr(new geo::Box(geo::Vec3(-0.2, -0.2, 0), geo::Vec3(0.2, 0.2, 1))));
+    req.setPose("box-1", geo::Pose3D(geo::Mat3::identity(), geo::Vec3(2.5, 1.5, 0)));
+
+    req.setShape("box-2", geo::ShapePtr(new geo::Box(geo::Vec3(-0.2, -0.2, 0), geo::Vec3(0.2, 0.2, 1))));
+    req.setPose("box-2", geo::Pose3D(geo::Mat3::identity(), geo::Vec3(2.5, -1.5, 0)));
+
+    world.update(req);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Simulates the measurement of a sensor at the origin, looking along the x-axis, by rendering the world (including the
+// cabinet at its true pose) and adding some noise
+void simulateMeasurement(Fitter& fitter, const ed::WorldModel& world, FitterData& data)
+{
+    // The beams of the fitter point along the sensor y-axis
+    data.sensor_pose_xya.R.setRPY(0, 0, -M_PI / 2);
+    data.sensor_pose_xya.t = geo::Vec3(0, 0, 0);
+
+    std::vector<int> identifiers;
+    for(ed::WorldModel::const_iterator it = world.begin(); it != world.end(); ++it)
+        fitter.renderEntity(*it, data.sensor_pose_xya, 0, data.sensor_ranges, identifiers);
+
+    std::srand(0);
+    for(unsigned int i = 0; i < data.sensor_ranges.size(); ++i)
+    {
+        if (data.sensor_ranges[i] > 0)
+            data.sensor_ranges[i] += 0.02 * ((double)std::rand() / RAND_MAX - 0.5);
+    }
+
+    // Only used with distance field scoring
+    fitter.calculateDistanceField(data);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Prints the difference between the poses, and returns true if they are the same
+bool comparePoses(const std::string& name_1, const geo::Pose3D& pose_1, const std::string& name_2, const geo::Pose3D& pose_2)
+{
+    geo::Pose3D delta = pose_1.inverse() * pose_2;
+
+    // Rotation angle of the delta rotation matrix
+    double c = std::max(-1.0, std::min(1.0, (delta.R.xx + delta.R.yy + delta.R.zz - 1) / 2));
+    double angle = std::acos(c);
+
+    std::cout << "Difference between " << name_1 << " and " << name_2 << ": " << delta.t.length() << " m, "
+              << angle << " rad" << std::endl;
+
+    return delta.t.length() <= 1e-6 && angle <= 1e-6;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Runs the pose estimation a number of times. Returns false if no pose was found.
+bool benchmark(Fitter& fitter, const FitterData& data, const ed::WorldModel& world, const geo::Pose3D& expected_pose,
+               unsigned int num_iterations, geo::Pose3D& fitted_pose, double& ms, double& allocations)
+{
+    // Warm up (e.g., to create the 2D entity shapes)
+    fitter.estimateEntityPose(data, world, "cabinet", expected_pose, fitted_pose);
+
+    tue::Timer timer;
+    timer.start();
+
+    unsigned long num_allocations_start = num_allocations;
+    bool found = true;
+
+    for(unsigned int i = 0; i < num_iterations; ++i)
+        found = fitter.estimateEntityPose(data, world, "cabinet", expected_pose, fitted_pose) && found;
+
+    unsigned long n = num_allocations - num_allocations_start;
+
+    timer.stop();
+
+    ms = timer.getElapsedTimeInMilliSec() / num_iterations;
+    allocations = (double)n / num_iterations;
+
+    return found;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void usage()
+{
+    std::cout << "Usage: ed_fitter_benchmark [ NUM-ITERATIONS [ NUM-THREADS ] ]" << std::endl;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+int main(int argc, char **argv)
+{
+    if (argc > 3)
+    {
+        usage();
+        return 1;
+    }
+
+    unsigned int num_iterations = 20;
+    if (argc > 1)
+        num_iterations = std::atoi(argv[1]);
+
+    unsigned int num_threads = 4;
+    if (argc > 2)
+        num_threads = std::atoi(argv[2]);
+
+    geo::Mat3 R_cabinet;
+    R_cabinet.setRPY(0, 0, 0.3);
+    geo::Pose3D cabinet_pose(R_cabinet, geo::Vec3(2, 0.1, 0));
+
+    ed::WorldModel world;
+    createWorld(cabinet_pose, world);
+
+    Fitter fitter;
+
+    FitterData data;
+    simulateMeasurement(fitter, world, data);
+
+    // Start from a slightly wrong pose
+    geo::Mat3 R_expected;
+    R_expected.setRPY(0, 0, 0.2);
+    geo::Pose3D expected_pose(R_expected, geo::Vec3(2.1, 0, 0));
+
+    std::cout << "True pose: " << cabinet_pose << std::endl;
+
+    // Compare branch-and-bound with exhaustive search, a single thread with multiple threads, beam scoring with distance
+    // field scoring, and the default search resolution with a coarse one (with and without refinement)
+    struct Config
+    {
+        const char* name;
+        bool exhaustive;
+        Fitter::ScoringMethod scoring;
+        unsigned int beam_step;
+        double yaw_step;
+        unsigned int refinement_iterations;
+        unsigned int num_threads;
+    };
+
+    Config configs[] = {
+        { "Branch-and-bound", false, Fitter::BEAM_SCORING, 1, 0.1, 10, 1 },
+        { "Exhaustive search", true, Fitter::BEAM_SCORING, 1, 0.1, 10, 1 },
+        { "Branch-and-bound, multiple threads", false, Fitter::BEAM_SCORING, 1, 0.1, 10, num_threads },
+        { "Exhaustive search, multiple threads", true, Fitter::BEAM_SCORING, 1, 0.1, 10, num_threads },
+        { "Distance field scoring", false, Fitter::DISTANCE_FIELD_SCORING, 1, 0.1, 10, 1 },
+        { "Without refinement", false, Fitter::BEAM_SCORING, 1, 0.1, 0, 1 },
+        { "Coarse search", false, Fitter::BEAM_SCORING, 4, 0.3, 0, 1 },
+        { "Coarse search with refinement", false, Fitter::BEAM_SCORING, 4, 0.3, 10, 1 }
+    };
+
+    unsigned int num_configs = sizeof(configs) / sizeof(configs[0]);
+
+    std::vector<geo::Pose3D> fitted_poses(num_configs);
+    for(unsigned int i = 0; i < num_configs; ++i)
+    {
+        const Config& c = configs[i];
+        fitter.setExhaustiveSearch(c.exhaustive);
+        fitter.setScoringMethod(c.scoring);
+        fitter.setSearchResolution(c.beam_step, c.yaw_step);
+        fitter.setRefinement(c.refinement_iterations);
+        fitter.setNumThreads(c.num_threads);
+
+        double ms, allocations;
+        if (!benchmark(fitter, data, world, expected_pose, num_iterations, fitted_poses[i], ms, allocations))
+        {
+            std::cout << c.name << ": no pose found" << std::endl;
+            return 1;
+        }
+
+        FitterRefinement refinement;
+        geo::Pose3D pose;
+        fitter.estimateEntityPose(data, world, "cabinet", expected_pose, pose, M_PI, false, &refinement);
+
+        std::cout << std::endl << c.name << std::endl;
+        std::cout << "    Fitted pose: " << fitted_poses[i] << std::endl;
+        std::cout << "    Position error: " << (fitted_poses[i].t - cabinet_pose.t).length() << " m" << std::endl;
+        if (c.refinement_iterations > 0)
+            std::cout << "    Refinement: " << refinement.iterations << " iteration(s), "
+                      << (refinement.converged ? "converged" : "not converged") << ", "
+                      << (refinement.accepted ? "accepted" : "rejected") << std::endl;
+        std::cout << "    estimateEntityPose: " << ms << " ms, " << allocations << " heap allocations per call" << std::endl;
+    }
+
+    // All of these must give exactly the same pose
+    std::cout << std::endl;
+    for(unsigned int i = 1; i < 4; ++i)
+    {
+        if (!comparePoses(configs[0].name, fitted_poses[0], configs[i].name, fitted_poses[i]))
+            return 1;
+    }
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // The same for a cabinet near the side of the field of view, such that the best candidate is placed on an
+    // off-center beam, and the bounds of the branch-and-bound have to cover a large angle
+
+    geo::Mat3 R_side;
+    R_side.setRPY(0, 0, 1.0);
+    geo::Pose3D side_pose(R_side, geo::Vec3(1.8, 0.9, 0));
+
+    ed::WorldModel side_world;
+    createWorld(side_pose, side_world);
+
+    FitterData side_data;
+    simulateMeasurement(fitter, side_world, side_data);
+
+    geo::Mat3 R_side_expected;
+    R_side_expected.setRPY(0, 0, 0.9);
+    geo::Pose3D side_expected_pose(R_side_expected, geo::Vec3(1.9, 0.8, 0));
+
+    fitter.setScoringMethod(Fitter::BEAM_SCORING);
+    fitter.setSearchResolution(1, 0.1);
+    fitter.setRefinement(0);
+    fitter.setNumThreads(1);
+
+    geo::Pose3D side_poses[2];
+    for(unsigned int i = 0; i < 2; ++i)
+    {
+        fitter.setExhaustiveSearch(i == 1);
+        if (!fitter.estimateEntityPose(side_data, side_world, "cabinet", side_expected_pose, side_poses[i]))
+        {
+            std::cout << "Cabinet at the side: no pose found" << std::endl;
+            return 1;
+        }
+    }
+
+    std::cout << std::endl << "Cabinet at the side" << std::endl;
+    std::cout << "    True pose: " << side_pose << std::endl;
+    std::cout << "    Fitted pose: " << side_poses[0] << std::endl;
+
+    if (!comparePoses("branch-and-bound", side_poses[0], "exhaustive search", side_poses[1]))
+        return 1;
+
+    return 0;
+}
@@ -0,0 +1,114 @@
+#include <ed/kinect/background_renderer.h>
+
+#include <ed/world_model.h>
+#include <ed/update_request.h>
+#include <ed/uuid.h>
+
+#include <geolib/sensors/DepthCamera.h>
+#include <geolib/Box.h>
+
+#include <tue/profiling/timer.h>
+
+#include <boost/thread/thread.hpp>
+
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+
+// ----------------------------------------------------------------------------------------------------
+
+// Creates a world with a grid of boxes in front of (and around) the sensor origin
+void createWorld(unsigned int num_entities, ed::WorldModel& world)
+{
+    ed::UpdateRequest req;
+
+    unsigned int grid_size = 1;
+    while (grid_size * grid_size < num_entities)
+        ++grid_size;
+
+    for(unsigned int i = 0; i < num_entities; ++i)
+    {
+        double x = -5 + 10.0 * (i % grid_size) / grid_size;
+        double y = -5 + 10.0 * (i / grid_size) / grid_size;
+
+        std::stringstream id;
+        id << "box-" << i;
+
+        geo::ShapePtr shape(new geo::Box(geo::Vec3(-0.2, -0.2, 0), geo::Vec3(0.2, 0.2, 0.5 + 0.01 * (i % 100))));
+        req.setShape(id.str(), shape);
+        req.setPose(id.str(), geo::Pose3D(geo::Mat3::identity(), geo::Vec3(x, y, 0)));
+    }
+
+    world.update(req);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void usage()
+{
+    std::cout << "Usage: ed_render_benchmark [ MAX-NUM-THREADS ] [ NUM-ENTITIES ]" << std::endl;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+int main(int argc, char **argv)
+{
+    if (argc > 3)
+    {
+        usage();
+        return 1;
+    }
+
+    unsigned int max_num_threads = boost::thread::hardware_concurrency();
+    unsigned int num_entities = 500;
+
+    if (argc > 1)
+        max_num_threads = std::atoi(argv[1]);
+
+    if (argc > 2)
+        num_entities = std::atoi(argv[2]);
+
+    ed::WorldModel world;
+    createWorld(num_entities, world);
+
+    // Kinect-like camera, 640x480
+    int width = 640;
+    int height = 480;
+    geo::DepthCamera cam(width, height, 554.25, 554.25, 320.5, 240.5, 0, 0);
+
+    // Sensor at 1 meter height looking horizontally along the x-axis
+    geo::Mat3 R;
+    R.setRPY(1.57, 0, -1.57);
+    geo::Pose3D sensor_pose(R, geo::Vec3(0, 0, 1));
+
+    unsigned int num_iterations = 20;
+
+    std::cout << num_entities << " entities, " << width << "x" << height << ", " << num_iterations << " iterations" << std::endl;
+
+    double t_single = 0;
+    for(unsigned int num_threads = 1; num_threads <= std::max(1u, max_num_threads); ++num_threads)
+    {
+        BackgroundRenderer renderer;
+        renderer.setNumThreads(num_threads);
+
+        tue::Timer timer;
+        timer.start();
+
+        for(unsigned int i = 0; i < num_iterations; ++i)
+        {
+            // Force a complete re-render
+            renderer.clear();
+            renderer.render(world, cam, sensor_pose, width, height);
+        }
+
+        timer.stop();
+
+        double t = timer.getElapsedTimeInMilliSec() / num_iterations;
+        if (num_threads == 1)
+            t_single = t;
+
+        std::cout << num_threads << " thread(s): " << t << " ms per render (speed-up: " << t_single / t << ")" << std::endl;
+    }
+
+    return 0;
+}